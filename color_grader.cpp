@@ -5,11 +5,20 @@
 ///
 ///  How to use:
 ///     Set the properties with the set* functions and then call grade
-///     it will produce a 3D volume texture 16x16x16 in size (RGB). Which
+///     it will produce a 3D volume texture NxNxN in size (RGB). Which
 ///     can be used to color grade in a GLSL/ESSL/HLSL/etc shader.
+///     Grading can be spread across threads with setThreads. Calling
+///     grade again only redoes the work affected by the properties that
+///     changed, e.g. changing just the brightness doesn't redo the color
+///     balance.
+///
+///     The size defaults to 16 and can be anything from 2 to 256, 17, 33
+///     and 65 are the common choices. Texels are either 8-bit unorm (the
+///     default), 16-bit unorm or half-float, 16-bit formats keep the
+///     precision of the brightness & contrast adjustment.
 ///
 /// Example:
-///     grader g;
+///     grader g(33, grader::kFormatRGB16F);
 ///     g.setBrightness(-0.85);
 ///     g.setContrast(0.35);
 ///     g.setLuma(true); // Preserve luma
@@ -23,7 +32,7 @@
 ///     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
 ///     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 ///     glTexParameteri(GL_TEXTURE_3D, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-///     glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB8, 16, 16, 16, 0, GL_RGB, GL_UNSIGNED_BYTE,
+///     glTexImage3D(GL_TEXTURE_3D, 0, GL_RGB16F, 33, 33, 33, 0, GL_RGB, GL_HALF_FLOAT,
 ///        g.data());
 ///
 ///     FRAGMENT SHADER:
@@ -33,11 +42,30 @@
 ///     ...
 ///     fragColor = vec4(texture(gColorGradingMap, fragColor.rgb).rbg, 1.0);
 ///
+///     The LUT can also be applied on the CPU to 8-bit RGB images with apply,
+///     which does tetrahedral interpolation and uses the same threads.
+///     g.apply(image, graded, width * height);
+///
+///     Build with -DCOLOR_GRADER_BENCHMARK for a benchmark of grade in LUTs/s,
+///     with and without luma preservation, and of apply in MP/s.
+///     Build with -DCOLOR_GRADER_FIXED_POINT to use integer versions of the
+///     color space conversions, they give the same results. Build with
+///     -DCOLOR_GRADER_TEST to check that for every input.
+///
 /// License: MIT
 /// By Dale Weler (graphitemaster)
+#include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 
+#include <thread>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
 /// UTILITIES
 namespace u {
 
@@ -65,10 +93,49 @@ int round(double val) {
     return int(val + 0.5);
 }
 
+// Float to half-float conversion with rounding to nearest even. Only handles
+// finite values from zero up to the largest half-float, which is all the
+// grader produces.
+uint16_t convertToHalf(float val) {
+    union { float asFloat; uint32_t asInt; } shape = { val };
+    if (shape.asInt < (113u << 23)) {
+        // Subnormal result, adding 0.5 aligns the 10 mantissa bits at the
+        // bottom of the float and the FPU does the rounding.
+        shape.asFloat += 0.5f;
+        return uint16_t(shape.asInt - 0x3F000000u);
+    }
+    // Rebias the exponent and round with just under half an ULP plus the
+    // ULP's low bit, which breaks ties towards even.
+    const uint32_t odd = (shape.asInt >> 13) & 1;
+    shape.asInt += 0xFFF + odd;
+    shape.asInt -= 112u << 23;
+    return uint16_t(shape.asInt >> 13);
+}
+
+// Half-float to float conversion, again only for what the grader produces.
+float convertToFloat(uint16_t val) {
+    union { uint32_t asInt; float asFloat; } shape = { uint32_t(val) << 13 };
+    // Rebias the exponent, subnormals need the FPU to renormalize them
+    if (shape.asInt < (1u << 23)) {
+        shape.asInt += 113u << 23;
+        return shape.asFloat - 6.103515625e-05f;
+    }
+    shape.asInt += 112u << 23;
+    return shape.asFloat;
+}
+
 }
 
 struct grader {
-    grader();
+    enum {
+        kFormatRGB8,   // GL_RGB8, GL_UNSIGNED_BYTE
+        kFormatRGB16,  // GL_RGB16, GL_UNSIGNED_SHORT
+        kFormatRGB16F  // GL_RGB16F, GL_HALF_FLOAT
+    };
+
+    static constexpr size_t kDefaultSize = 16u;
+
+    grader(size_t size = kDefaultSize, int format = kFormatRGB8);
     void setBrightness(double brightness);
     void setContrast(double contrast);
     double brightness() const;
@@ -90,21 +157,68 @@ struct grader {
     double MG(int what) const;
     double YB(int what) const;
 
-    unsigned char *data() const;
+    // Number of threads used by grade, defaults to one.
+    void setThreads(size_t threads);
+    size_t threads() const;
+
+    // The LUT is size() texels along each axis in format(), data() is
+    // bytes() long.
+    size_t size() const;
+    int format() const;
+    size_t bytes() const;
+    const unsigned char *data() const;
 
     void grade();
 
+    // Grade 8-bit RGB pixels on the CPU with the LUT from the last call to
+    // grade. The pixels are split into runs across the threads, in and out
+    // may be the same.
+    void apply(const uint8_t *rgb, uint8_t *out, size_t pixels) const;
+
 protected:
     void brightnessContrast();
     void generateTexture();
     void generateColorBalanceTables();
 
-    // Color space conversion functions
+    // Color balance and preserve luma for rows [begin, end) of the 3D LUT
+    void preserveLumaRows(size_t begin, size_t end);
+
+    // Brightness & contrast for rows [begin, end) of the 3D LUT
+    template <typename T>
+    void gradeRows(size_t begin, size_t end);
+    void gradeRows(size_t begin, size_t end);
+
+    // Half-float LUT converted to 16-bit unorm for apply, rows [begin, end)
+    void latticeRows(size_t begin, size_t end);
+
+    // Run rows over all rows of the 3D LUT with the threads
+    void dispatch(void (grader::*rows)(size_t, size_t));
+
+    // Apply the LUT in lattice to pixels [begin, end)
+    template <typename T>
+    void applyPixels(const T *lattice, const uint8_t *rgb, uint8_t *out,
+        size_t begin, size_t end) const;
+    template <typename T>
+    void applyPixels(const T *lattice, const uint8_t *rgb, uint8_t *out,
+        size_t pixels) const;
+
+    // Color space conversion functions, the fixed point versions are used
+    // with COLOR_GRADER_FIXED_POINT and the double versions otherwise. Both
+    // are built with COLOR_GRADER_TEST so they can be compared.
     static void RGB2HSL(int &red, int &green, int &blue);
-    static int HSLINT(double n1, double n2, double hue);
     static void HSL2RGB(int &hue, int &saturation, int &lightness);
     static int RGB2L(int red, int green, int blue);
 
+    static void RGB2HSLFixed(int &red, int &green, int &blue);
+    static int HSLINTFixed(int m1, int m2, int hue);
+    static void HSL2RGBFixed(int &hue, int &saturation, int &lightness);
+    static int RGB2LFixed(int red, int green, int blue);
+
+    static void RGB2HSLDouble(int &red, int &green, int &blue);
+    static int HSLINTDouble(double n1, double n2, double hue);
+    static void HSL2RGBDouble(int &hue, int &saturation, int &lightness);
+    static int RGB2LDouble(int red, int green, int blue);
+
 private:
     // Brightness & contrast
     double m_brightness;
@@ -117,32 +231,83 @@ private:
     double m_balanceSub[256][kBalanceMax];
     unsigned char m_balanceLookup[3][256];
 
-    // 3D LUT
-    static constexpr size_t kWidth = 256u;
-    static constexpr size_t kHeight = 16u;
-    unsigned char m_data[kWidth * kHeight * 3];
+    // brightness and contrast as a lookup producing the texel in the output
+    // format, when luma is not preserved it's also folded with the color
+    // balance lookup.
+    uint16_t m_brightnessContrastLookup[256];
+    uint16_t m_lookup[3][256];
+
+    // The inputs each stage of grade was last run with, m_balanced is the
+    // color balanced volume with luma preserved before brightness & contrast.
+    bool m_graded;
+    double m_gradedBalance[3][kBalanceMax];
+    bool m_gradedLuma;
+    double m_gradedBrightness;
+    double m_gradedContrast;
+    bool m_balancedValid;
+    std::vector<unsigned char> m_balanced;
+
+    size_t m_threads;
+
+    // 3D LUT, laid out as m_size rows of green, each row is m_size*m_size
+    // texels where red varies fastest followed by blue. m_coordinates holds
+    // the 8-bit color for each lattice coordinate.
+    size_t m_size;
+    size_t m_width;
+    size_t m_height;
+    int m_format;
+    std::vector<int> m_coordinates;
+    std::vector<unsigned char> m_data;
+
+    // apply interpolates half-floats as 16-bit unorm, the copy of the LUT in
+    // that format is kept up to date by grade so apply doesn't convert it.
+    std::vector<uint16_t> m_lattice;
+
+    // apply reads whole 32-bit words from the LUT so there's padding after
+    // the last texel.
+    static constexpr size_t kPadding = 4u;
 };
 
-grader::grader()
+grader::grader(size_t size, int format)
     : m_brightness(0.0)
     , m_contrast(0.0)
     , m_preserveLuma(true)
+    , m_graded(false)
+    , m_gradedLuma(false)
+    , m_gradedBrightness(0.0)
+    , m_gradedContrast(0.0)
+    , m_balancedValid(false)
+    , m_threads(1)
+    , m_size(size)
+    , m_width(size * size)
+    , m_height(size)
+    , m_format(format)
 {
+    assert(size >= 2 && size <= 256);
     memset(m_balance, 0, sizeof(m_balance));
 
+    m_coordinates.resize(m_size);
+    for (size_t i = 0; i < m_size; i++)
+        m_coordinates[i] = u::round(255.0 * i / (m_size - 1));
+    m_data.resize(bytes() + kPadding);
+
     generateTexture();
+    if (m_format == kFormatRGB16F) {
+        m_lattice.resize(m_width * m_height * 3 + kPadding / sizeof(uint16_t));
+        dispatch(&grader::latticeRows);
+    }
 
     // Compute color balance function for all 256 pixel values for shadows,
     // midtones and highlights.
     for (size_t i = 0; i < 256; i++) {
-        const double low = (1.075 - 1 / double(i) / 16.0 + 1);
-        const double mid = 0.667 * (1 - u::square((double(i) - 127.0) - 127.0));
-        m_balanceAdd[kBalanceShadows][i] = low;
-        m_balanceSub[kBalanceShadows][255 - i] = low;
-        m_balanceAdd[kBalanceMidtones][i] = mid;
-        m_balanceSub[kBalanceMidtones][i] = mid;
-        m_balanceAdd[kBalanceHighlights][255 - i] = low;
-        m_balanceSub[kBalanceHighlights][i] = low;
+        const double low = 1.075 - 1 / (double(i) / 16.0 + 1);
+        const double mid = 0.667 * (1 - u::square((double(i) - 127.0) / 127.0));
+        m_balanceAdd[i][kBalanceShadows] = low;
+        m_balanceSub[255 - i][kBalanceShadows] = low;
+        m_balanceAdd[i][kBalanceMidtones] = mid;
+        m_balanceSub[i][kBalanceMidtones] = mid;
+        m_balanceAdd[255 - i][kBalanceHighlights] = low;
+        m_balanceSub[i][kBalanceHighlights] = low;
     }
 }
 
@@ -167,9 +332,6 @@ void grader::brightnessContrast() {
     const float contrast = float(m_contrast);
     float gain = 1.0f;
 
-    unsigned char *src = m_data;
-    unsigned char *dst = m_data;
-
     //  if -1 <= contrast < 0, 0 <= gain < 1
     //  if contrast = 0; gain = 1 or no change
     //  if 0 > contrast < 1, 1 < gain < infinity
@@ -183,53 +345,209 @@ void grader::brightnessContrast() {
     // 1/2(gain *max - max), where max = 2^8-1
     const float shift = (gain * 127.5f - 127.5f) - 0.5f;
 
-    for (size_t h = 0; h < kHeight; h++) {
-        unsigned char *s = src;
-        unsigned char *d = dst;
-        for (size_t w = 0; w < kWidth; w++) {
-            for (size_t b = 0; b < 3; b++) {
-                // Brightness & contrast correction
-                const float tmp = u::clamp(gain*(brightness + s[b]) - shift, 0.0f, 255.0f);
-                d[b] = (unsigned char)(tmp);
-            }
-            s += 3;
-            d += 3;
+    // Brightness & contrast correction only depends on the channel value so
+    // it's computed for all of them up front and applied in the grading pass.
+    for (size_t i = 0; i < 256; i++) {
+        const float tmp = u::clamp(gain*(brightness + i) - shift, 0.0f, 255.0f);
+        switch (m_format) {
+        case kFormatRGB8:
+            m_brightnessContrastLookup[i] = (unsigned char)(tmp);
+            break;
+        case kFormatRGB16:
+            m_brightnessContrastLookup[i] = uint16_t(tmp * 257.0f);
+            break;
+        case kFormatRGB16F:
+            m_brightnessContrastLookup[i] = u::convertToHalf(tmp / 255.0f);
+            break;
         }
-        src += 3*kWidth;
-        dst += 3*kWidth;
     }
 }
 
 void grader::generateTexture() {
     // Generate the 3D volume texture
-    unsigned char *next = m_data;
-    for (size_t y = 0; y < kHeight; y++) {
-        for (size_t x = 0; x < kWidth; x++) {
-            *next++ = 17 * (x % 16);
-            *next++ = 17 * y;
-            *next++ = 17 * (x / 16);
+    const size_t n = m_size;
+    uint16_t texel[256];
+    for (size_t i = 0; i < 256; i++) {
+        switch (m_format) {
+        case kFormatRGB8:
+            texel[i] = i;
+            break;
+        case kFormatRGB16:
+            texel[i] = i * 257;
+            break;
+        case kFormatRGB16F:
+            texel[i] = u::convertToHalf(i / 255.0f);
+            break;
+        }
+    }
+    unsigned char *next8 = &m_data[0];
+    uint16_t *next16 = (uint16_t *)&m_data[0];
+    for (size_t y = 0; y < m_height; y++) {
+        for (size_t x = 0; x < m_width; x++) {
+            const int color[3] = {
+                m_coordinates[x % n],
+                m_coordinates[y],
+                m_coordinates[x / n]
+            };
+            for (size_t i = 0; i < 3; i++) {
+                if (m_format == kFormatRGB8)
+                    *next8++ = texel[color[i]];
+                else
+                    *next16++ = texel[color[i]];
+            }
         }
     }
 }
 
 void grader::generateColorBalanceTables() {
-    double *transfer[3][kBalanceMax];
+    const double (*transfer[3][kBalanceMax])[kBalanceMax];
     for (size_t i = kBalanceShadows; i < kBalanceMax; i++)
         for (size_t j = 0; j < 3; j++)
-            transfer[j][i] = m_balance[j][i] > 0.0 ? m_balanceAdd[i] : m_balanceSub[i];
+            transfer[j][i] = m_balance[j][i] > 0.0 ? m_balanceAdd : m_balanceSub;
     for (size_t i = 0; i < 256; i++) {
         int color[3];
         for (size_t j = 0; j < 3; j++)
             color[j] = i;
         for (size_t j = 0; j < 3; j++)
             for (size_t k = kBalanceShadows; k < kBalanceMax; k++)
-                color[j] = u::clamp(color[j] + m_balance[j][k] * transfer[j][k][color[j]], 0.0, 255.0);
+                color[j] = u::clamp(color[j] + m_balance[j][k] * transfer[j][k][color[j]][k], 0.0, 255.0);
         for (size_t j = 0; j < 3; j++)
             m_balanceLookup[j][i] = color[j];
     }
 }
 
-void grader::RGB2HSL(int &red, int &green, int &blue) {
+#if defined(COLOR_GRADER_FIXED_POINT) || defined(COLOR_GRADER_TEST)
+// Integer versions of the color space conversion functions. Everything is
+// scaled so the results are exact rationals, the divides with a variable
+// divisor are done with a table of reciprocals. They give the same results
+// as the double versions.
+static struct reciprocalData {
+    reciprocalData();
+    // ceil(2^32 / d), a / d is (a * reciprocal[d]) >> 32 for the numerators
+    // and divisors used here.
+    uint64_t reciprocal[1024];
+} gReciprocalData;
+
+reciprocalData::reciprocalData() {
+    reciprocal[0] = 0;
+    for (uint64_t d = 1; d < 1024; d++)
+        reciprocal[d] = ((uint64_t(1) << 32) + d - 1) / d;
+}
+
+static inline int divide(int numerator, int denominator) {
+    return int((uint64_t(numerator) * gReciprocalData.reciprocal[denominator]) >> 32);
+}
+
+void grader::RGB2HSLFixed(int &red, int &green, int &blue) {
+    int r = red;
+    int g = green;
+    int b = blue;
+
+    int min;
+    int max;
+    if (r > g) {
+        max = u::max(r, b);
+        min = u::min(g, b);
+    } else {
+        max = u::max(g, b);
+        min = u::min(r, b);
+    }
+
+    int h = 0;
+    int s = 0;
+    const int sum = max + min;
+    if (max != min) {
+        const int delta = max - min;
+        // round(255 * delta / d) is (2 * 255 * delta + d) / 2d
+        const int d = sum < 256 ? sum : 511 - sum;
+        s = divide(510 * delta + d, 2 * d);
+
+        // The hue is n / 2delta in [-42.5, 212.5]
+        int n;
+        if (r == max)
+            n = 85 * (g - b);
+        else if (g == max)
+            n = 85 * (2 * delta + b - r);
+        else
+            n = 85 * (4 * delta + r - g);
+        if (n < 0)
+            n += 255 * 2 * delta;
+        h = divide(2 * n + 2 * delta, 4 * delta);
+
+        // When the hue is exactly halfway between two integers the double
+        // version can round either way depending on the error in computing
+        // it, do the same thing it does for those.
+        if (h * 4 * delta == 2 * n + 2 * delta) {
+            double hue;
+            if (r == max)
+                hue = (g - b) / double(delta);
+            else if (g == max)
+                hue = 2 + (b - r) / double(delta);
+            else
+                hue = 4 + (r - g) / double(delta);
+            hue *= 42.5;
+            if (hue < 0)
+                hue += 255.0;
+            h = u::round(hue);
+        }
+    }
+
+    red = h;
+    green = s;
+    blue = (sum + 1) / 2;
+}
+
+// m1 and m2 are scaled by 255^2
+int grader::HSLINTFixed(int m1, int m2, int hue) {
+    if (hue > 255)
+        hue -= 255;
+    else if (hue < 0)
+        hue += 255;
+
+    // The value is scaled by 255 * 255 * 85 so the ramps are exact
+    int value;
+    if (hue < 43)
+        value = 85 * m1 + 2 * hue * (m2 - m1);
+    else if (hue < 128)
+        value = 85 * m2;
+    else if (hue < 170)
+        value = 85 * m1 + 2 * (170 - hue) * (m2 - m1);
+    else
+        value = 85 * m1;
+
+    return (2 * value + 255 * 85) / (2 * 255 * 85);
+}
+
+void grader::HSL2RGBFixed(int &hue, int &saturation, int &lightness) {
+    int h = hue;
+    int s = saturation;
+    int l = lightness;
+    if (s == 0) { // Achromatic
+        hue = l;
+        saturation = l;
+        lightness = l;
+    } else { // Chromatic
+        int m2;
+        if (l < 128)
+            m2 = l * (255 + s);
+        else
+            m2 = 255 * (l + s) - l * s;
+        int m1 = 2 * 255 * l - m2;
+        hue = HSLINTFixed(m1, m2, h + 85);
+        saturation = HSLINTFixed(m1, m2, h);
+        lightness = HSLINTFixed(m1, m2, h - 85);
+    }
+}
+
+int grader::RGB2LFixed(int red, int green, int blue) {
+    const int max = u::max(u::max(red, green), blue);
+    const int min = u::min(u::min(red, green), blue);
+    return (max + min + 1) / 2;
+}
+#endif
+
+#if !defined(COLOR_GRADER_FIXED_POINT) || defined(COLOR_GRADER_TEST)
+void grader::RGB2HSLDouble(int &red, int &green, int &blue) {
     int r = red;
     int g = green;
     int b = blue;
@@ -274,7 +592,7 @@ void grader::RGB2HSL(int &red, int &green, int &blue) {
     blue = u::round(l);
 }
 
-int grader::HSLINT(double n1, double n2, double hue) {
+int grader::HSLINTDouble(double n1, double n2, double hue) {
     if (hue > 255.0)
         hue -= 255.0;
     else if (hue < 0.0)
@@ -293,7 +611,7 @@ int grader::HSLINT(double n1, double n2, double hue) {
     return u::round(value * 255.0);
 }
 
-void grader::HSL2RGB(int &hue, int &saturation, int &lightness) {
+void grader::HSL2RGBDouble(int &hue, int &saturation, int &lightness) {
     int h = hue;
     int s = saturation;
     int l = lightness;
@@ -308,13 +626,13 @@ void grader::HSL2RGB(int &hue, int &saturation, int &lightness) {
         else
             m2 = (l + s - (l * s) / 255.0) / 255.0;
         double m1 = (l / 127.5) - m2;
-        hue = HSLINT(m1, m2, h + 85);
-        saturation = HSLINT(m1, m2, h);
-        lightness = HSLINT(m1, m2, h - 85);
+        hue = HSLINTDouble(m1, m2, h + 85);
+        saturation = HSLINTDouble(m1, m2, h);
+        lightness = HSLINTDouble(m1, m2, h - 85);
     }
 }
 
-int grader::RGB2L(int red, int green, int blue) {
+int grader::RGB2LDouble(int red, int green, int blue) {
     int min = 0;
     int max = 0;
     if (red > green) {
@@ -326,35 +644,498 @@ int grader::RGB2L(int red, int green, int blue) {
     }
     return u::round((max + min) / 2.0);
 }
+#endif
 
-void grader::grade() {
-    generateColorBalanceTables();
-    unsigned char *src = m_data;
-    unsigned char *dst = m_data;
-    for (size_t h = 0; h < kHeight; h++) {
-        unsigned char *s = src;
-        unsigned char *d = dst;
-        for (size_t w = 0; w < kWidth; w++) {
+#ifdef COLOR_GRADER_FIXED_POINT
+inline void grader::RGB2HSL(int &red, int &green, int &blue) {
+    RGB2HSLFixed(red, green, blue);
+}
+
+inline void grader::HSL2RGB(int &hue, int &saturation, int &lightness) {
+    HSL2RGBFixed(hue, saturation, lightness);
+}
+
+inline int grader::RGB2L(int red, int green, int blue) {
+    return RGB2LFixed(red, green, blue);
+}
+#else
+inline void grader::RGB2HSL(int &red, int &green, int &blue) {
+    RGB2HSLDouble(red, green, blue);
+}
+
+inline void grader::HSL2RGB(int &hue, int &saturation, int &lightness) {
+    HSL2RGBDouble(hue, saturation, lightness);
+}
+
+inline int grader::RGB2L(int red, int green, int blue) {
+    return RGB2LDouble(red, green, blue);
+}
+#endif
+
+#ifdef __AVX2__
+// SIMD versions of the color space conversion functions for four texels at a
+// time. They do the same double precision math as the scalar versions in the
+// same order so the results are identical, the branches become selects.
+static inline __m256d selectAVX(__m256d mask, __m256d a, __m256d b) {
+    return _mm256_blendv_pd(b, a, mask);
+}
+
+// u::round, only valid for values greater than -0.5
+static inline __m256d roundAVX(__m256d value) {
+    return _mm256_cvtepi32_pd(_mm256_cvttpd_epi32(_mm256_add_pd(value, _mm256_set1_pd(0.5))));
+}
+
+static inline __m256d HSLINTAVX(__m256d n1, __m256d n2, __m256d hue) {
+    const __m256d k0 = _mm256_setzero_pd();
+    const __m256d k42 = _mm256_set1_pd(42.5);
+    const __m256d k127 = _mm256_set1_pd(127.5);
+    const __m256d k170 = _mm256_set1_pd(170.0);
+    const __m256d k255 = _mm256_set1_pd(255.0);
+
+    hue = selectAVX(_mm256_cmp_pd(hue, k255, _CMP_GT_OQ), _mm256_sub_pd(hue, k255),
+          selectAVX(_mm256_cmp_pd(hue, k0, _CMP_LT_OQ), _mm256_add_pd(hue, k255), hue));
+
+    // The rising and falling edges only differ in the distance along the ramp
+    // so pick that first and only divide once.
+    const __m256d rising = _mm256_cmp_pd(hue, k42, _CMP_LT_OQ);
+    const __m256d distance = selectAVX(rising, hue, _mm256_sub_pd(k170, hue));
+    const __m256d ramp = _mm256_add_pd(n1, _mm256_mul_pd(_mm256_sub_pd(n2, n1), _mm256_div_pd(distance, k42)));
+
+    __m256d value = n1;
+    value = selectAVX(_mm256_cmp_pd(hue, k170, _CMP_LT_OQ), ramp, value);
+    value = selectAVX(_mm256_cmp_pd(hue, k127, _CMP_LT_OQ), n2, value);
+    value = selectAVX(rising, ramp, value);
+
+    return roundAVX(_mm256_mul_pd(value, k255));
+}
+
+// Replaces the lightness of the balanced colors with the lightness `l' of the
+// original colors, like RGB2HSL, RGB2L and HSL2RGB do in the scalar version.
+static inline void preserveLumaAVX(__m256d &red, __m256d &green, __m256d &blue, __m256d l) {
+    const __m256d k0 = _mm256_setzero_pd();
+    const __m256d k2 = _mm256_set1_pd(2.0);
+    const __m256d k4 = _mm256_set1_pd(4.0);
+    const __m256d kHalf = _mm256_set1_pd(0.5);
+    const __m256d k42 = _mm256_set1_pd(42.5);
+    const __m256d k85 = _mm256_set1_pd(85.0);
+    const __m256d k127 = _mm256_set1_pd(127.5);
+    const __m256d k128 = _mm256_set1_pd(128.0);
+    const __m256d k255 = _mm256_set1_pd(255.0);
+    const __m256d k511 = _mm256_set1_pd(511.0);
+    const __m256d k65025 = _mm256_set1_pd(65025.0);
+
+    // RGB2HSL
+    const __m256d r = red;
+    const __m256d g = green;
+    const __m256d b = blue;
+    const __m256d max = _mm256_max_pd(_mm256_max_pd(r, g), b);
+    const __m256d min = _mm256_min_pd(_mm256_min_pd(r, g), b);
+    const __m256d sum = _mm256_add_pd(max, min);
+    const __m256d delta = _mm256_sub_pd(max, min);
+    const __m256d chromatic = _mm256_cmp_pd(delta, k0, _CMP_NEQ_OQ);
+
+    // Grays are common enough that it's worth skipping all the work, the hue
+    // and saturation are zero so HSL2RGB just returns the lightness.
+    if (_mm256_movemask_pd(chromatic) == 0) {
+        red = l;
+        green = l;
+        blue = l;
+        return;
+    }
+
+    // Divides are the expensive part, so the operands of each branch are
+    // selected before dividing once rather than selecting between quotients.
+    const __m256d scaled = _mm256_mul_pd(k255, delta);
+    __m256d s = _mm256_div_pd(scaled, selectAVX(_mm256_cmp_pd(_mm256_mul_pd(sum, kHalf), k128, _CMP_LT_OQ),
+                                              sum, _mm256_sub_pd(k511, sum)));
+
+    const __m256d redMax = _mm256_cmp_pd(r, max, _CMP_EQ_OQ);
+    const __m256d greenMax = _mm256_cmp_pd(g, max, _CMP_EQ_OQ);
+    const __m256d numerator = selectAVX(redMax, _mm256_sub_pd(g, b),
+                              selectAVX(greenMax, _mm256_sub_pd(b, r), _mm256_sub_pd(r, g)));
+    const __m256d offset = selectAVX(redMax, k0, selectAVX(greenMax, k2, k4));
+    __m256d h = _mm256_mul_pd(_mm256_add_pd(offset, _mm256_div_pd(numerator, delta)), k42);
+    h = selectAVX(_mm256_cmp_pd(h, k0, _CMP_LT_OQ), _mm256_add_pd(h, k255),
+        selectAVX(_mm256_cmp_pd(h, k255, _CMP_GT_OQ), _mm256_sub_pd(h, k255), h));
+
+    // Achromatic is a zero hue and saturation, also masks the divide by zero
+    h = roundAVX(_mm256_and_pd(chromatic, h));
+    s = roundAVX(_mm256_and_pd(chromatic, s));
+
+    // HSL2RGB
+    const __m256d dark = _mm256_cmp_pd(l, k128, _CMP_LT_OQ);
+    const __m256d m2 = _mm256_div_pd(
+        selectAVX(dark, _mm256_mul_pd(l, _mm256_add_pd(k255, s)),
+                         _mm256_sub_pd(_mm256_add_pd(l, s), _mm256_div_pd(_mm256_mul_pd(l, s), k255))),
+        selectAVX(dark, k65025, k255));
+    const __m256d m1 = _mm256_sub_pd(_mm256_div_pd(l, k127), m2);
+    const __m256d saturated = _mm256_cmp_pd(s, k0, _CMP_NEQ_OQ);
+
+    red = selectAVX(saturated, HSLINTAVX(m1, m2, _mm256_add_pd(h, k85)), l);
+    green = selectAVX(saturated, HSLINTAVX(m1, m2, h), l);
+    blue = selectAVX(saturated, HSLINTAVX(m1, m2, _mm256_sub_pd(h, k85)), l);
+}
+#endif
+
+void grader::preserveLumaRows(size_t begin, size_t end) {
+    // The texel values come straight from the coordinates in the volume rather
+    // than from m_data, which is the same thing generateTexture would produce.
+    const size_t n = m_size;
+    const int *const coordinates = &m_coordinates[0];
+    for (size_t y = begin; y < end; y++) {
+        unsigned char *d = &m_balanced[3*m_width*y];
+        // Red and blue coordinates of the next texel along the row
+        size_t r = 0;
+        size_t b = 0;
+        size_t x = 0;
+#ifdef __AVX2__
+        for (; x + 4 <= m_width; x += 4) {
+            int l[4][3];
+            double c[3][4];
+            double luma[4];
+            for (size_t i = 0; i < 4; i++) {
+                l[i][0] = coordinates[r];
+                l[i][1] = coordinates[y];
+                l[i][2] = coordinates[b];
+                if (++r == n) {
+                    r = 0;
+                    b++;
+                }
+                for (size_t j = 0; j < 3; j++)
+                    c[j][i] = m_balanceLookup[j][l[i][j]];
+                luma[i] = RGB2L(l[i][0], l[i][1], l[i][2]);
+            }
+            __m256d red = _mm256_loadu_pd(c[0]);
+            __m256d green = _mm256_loadu_pd(c[1]);
+            __m256d blue = _mm256_loadu_pd(c[2]);
+            preserveLumaAVX(red, green, blue, _mm256_loadu_pd(luma));
+
+            alignas(16) int v[3][4];
+            _mm_store_si128((__m128i *)v[0], _mm256_cvttpd_epi32(red));
+            _mm_store_si128((__m128i *)v[1], _mm256_cvttpd_epi32(green));
+            _mm_store_si128((__m128i *)v[2], _mm256_cvttpd_epi32(blue));
+            for (size_t i = 0; i < 4; i++)
+                for (size_t j = 0; j < 3; j++)
+                    *d++ = (unsigned char)v[j][i];
+        }
+#endif
+        for (; x < m_width; x++) {
             int l[3];
-            int n[3];
+            int v[3];
+            l[0] = coordinates[r];
+            l[1] = coordinates[y];
+            l[2] = coordinates[b];
+            if (++r == n) {
+                r = 0;
+                b++;
+            }
             for (size_t i = 0; i < 3; i++)
-                l[i] = s[i];
+                v[i] = m_balanceLookup[i][l[i]];
+            RGB2HSL(v[0], v[1], v[2]);
+            v[2] = RGB2L(l[0], l[1], l[2]);
+            HSL2RGB(v[0], v[1], v[2]);
             for (size_t i = 0; i < 3; i++)
-                n[i] = m_balanceLookup[i][l[i]];
-            if (m_preserveLuma) {
-                RGB2HSL(n[0], n[1], n[2]);
-                n[2] = RGB2L(l[0], l[1], l[2]);
-                HSL2RGB(n[0], n[1], n[2]);
+                *d++ = (unsigned char)v[i];
+        }
+    }
+}
+
+template <typename T>
+void grader::gradeRows(size_t begin, size_t end) {
+    const size_t n = m_size;
+    const int *const coordinates = &m_coordinates[0];
+    for (size_t y = begin; y < end; y++) {
+        T *d = (T *)&m_data[0] + 3*m_width*y;
+        if (!m_preserveLuma) {
+            // Color balance and brightness & contrast are folded into one lookup
+            const T green = m_lookup[1][coordinates[y]];
+            for (size_t b = 0; b < n; b++) {
+                const T blue = m_lookup[2][coordinates[b]];
+                for (size_t r = 0; r < n; r++) {
+                    *d++ = m_lookup[0][coordinates[r]];
+                    *d++ = green;
+                    *d++ = blue;
+                }
             }
-            for (size_t i = 0; i < 3; i++)
-                d[i] = n[i];
-            s += 3;
-            d += 3;
+            continue;
+        }
+        const unsigned char *balanced = &m_balanced[3*m_width*y];
+        for (size_t x = 0; x < 3*m_width; x++)
+            *d++ = m_brightnessContrastLookup[*balanced++];
+    }
+}
+
+void grader::gradeRows(size_t begin, size_t end) {
+    if (m_format == kFormatRGB8)
+        gradeRows<unsigned char>(begin, end);
+    else
+        gradeRows<uint16_t>(begin, end);
+}
+
+void grader::latticeRows(size_t begin, size_t end) {
+    const uint16_t *const data = (const uint16_t *)&m_data[0];
+    for (size_t i = 3*m_width*begin; i < 3*m_width*end; i++)
+        m_lattice[i] = uint16_t(u::convertToFloat(data[i]) * 65535.0f + 0.5f);
+}
+
+void grader::dispatch(void (grader::*rows)(size_t, size_t)) {
+    // Rows are independent so they are split evenly across the threads, the
+    // calling thread does the first share.
+    const size_t threads = u::min(m_threads, m_height);
+    const size_t count = (m_height + threads - 1) / threads;
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) {
+        const size_t begin = i * count;
+        const size_t end = u::min(begin + count, m_height);
+        if (begin < end)
+            pool.emplace_back([this, rows, begin, end]() { (this->*rows)(begin, end); });
+    }
+    (this->*rows)(0, u::min(count, m_height));
+    for (auto &it : pool)
+        it.join();
+}
+
+void grader::grade() {
+    // Grading is a pipeline of stages, the color balance tables, the color
+    // balanced volume with luma preserved and then brightness & contrast.
+    // Each stage only reruns when the inputs it was last run with changed or
+    // an earlier stage reran, so moving a single slider is cheap.
+    const bool balance = !m_graded
+        || memcmp(m_gradedBalance, m_balance, sizeof m_balance) != 0;
+    if (balance) {
+        generateColorBalanceTables();
+        memcpy(m_gradedBalance, m_balance, sizeof m_balance);
+        m_balancedValid = false;
+    }
+
+    // The balanced volume is kept when luma preservation is turned off so
+    // turning it back on only needs the last stage.
+    const bool luma = m_preserveLuma && !m_balancedValid;
+    if (luma) {
+        m_balanced.resize(m_width * m_height * 3);
+        dispatch(&grader::preserveLumaRows);
+        m_balancedValid = true;
+    }
+
+    const bool adjust = !m_graded
+        || m_gradedBrightness != m_brightness
+        || m_gradedContrast != m_contrast;
+    if (adjust) {
+        brightnessContrast();
+        m_gradedBrightness = m_brightness;
+        m_gradedContrast = m_contrast;
+    }
+
+    if (balance || luma || adjust || m_gradedLuma != m_preserveLuma) {
+        if (!m_preserveLuma) {
+            for (size_t j = 0; j < 3; j++)
+                for (size_t i = 0; i < 256; i++)
+                    m_lookup[j][i] = m_brightnessContrastLookup[m_balanceLookup[j][i]];
         }
-        src += 3*kWidth;
-        dst += 3*kWidth;
+        dispatch(&grader::gradeRows);
+        if (m_format == kFormatRGB16F)
+            dispatch(&grader::latticeRows);
+        m_gradedLuma = m_preserveLuma;
+    }
+
+    m_graded = true;
+}
+
+// Tetrahedral interpolation splits each cube of the lattice into six
+// tetrahedra along the diagonal from the first corner to the opposite one.
+// Which tetrahedron a color falls in only depends on the order of the
+// fractional parts of its coordinates. Stepping along the axis with the
+// largest fraction, then the next largest, walks its corners and the weights
+// are the differences between the sorted fractions.
+template <typename T>
+void grader::applyPixels(const T *lattice, const uint8_t *rgb, uint8_t *out,
+    size_t begin, size_t end) const
+{
+    // Coordinates are scaled by this then split into a lattice index and the
+    // fraction. The last cube also handles the last lattice coordinate.
+    const float scale = float(m_size - 1) / 255.0f;
+    const int last = int(m_size - 2);
+    // Strides of red, green and blue through the lattice in elements
+    const int sr = 3;
+    const int sg = int(3 * m_width);
+    const int sb = int(3 * m_size);
+    // 16-bit texels are scaled back to 8-bit
+    const float unorm = sizeof(T) == 1 ? 1.0f : 1.0f / 257.0f;
+
+    size_t x = begin;
+#ifdef __AVX2__
+    const __m256i kByte = _mm256_set1_epi32(0xFF);
+    const __m256i kWord = _mm256_set1_epi32(0xFFFF);
+    const __m256i kLast = _mm256_set1_epi32(last);
+    const __m256i kPixel = _mm256_setr_epi32(0, 3, 6, 9, 12, 15, 18, 21);
+    const __m256i kPack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14,
+        -1, -1, -1, -1, 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    const __m256 kScale = _mm256_set1_ps(scale);
+    const __m256 kUnorm = _mm256_set1_ps(unorm);
+    const __m256 kOne = _mm256_set1_ps(1.0f);
+    const __m256 kHalf = _mm256_set1_ps(0.5f);
+    const __m256i kRed = _mm256_set1_epi32(sr);
+    const __m256i kGreen = _mm256_set1_epi32(sg);
+    const __m256i kBlue = _mm256_set1_epi32(sb);
+    const __m256i kStrides = _mm256_set1_epi32(sr + sg + sb);
+
+    // The pixels are gathered a 32-bit word at a time which reads the first
+    // byte of the next pixel, the loop stops one pixel early for that.
+    for (; x + 8 < end; x += 8) {
+        const __m256i pixel = _mm256_i32gather_epi32((const int *)&rgb[x*3], kPixel, 1);
+        __m256i index[3];
+        __m256 fraction[3];
+        for (int i = 0; i < 3; i++) {
+            const __m256 c = _mm256_cvtepi32_ps(
+                _mm256_and_si256(_mm256_srli_epi32(pixel, 8*i), kByte));
+            const __m256 f = _mm256_mul_ps(c, kScale);
+            index[i] = _mm256_min_epi32(_mm256_cvttps_epi32(f), kLast);
+            fraction[i] = _mm256_sub_ps(f, _mm256_cvtepi32_ps(index[i]));
+        }
+        const __m256 fr = fraction[0];
+        const __m256 fg = fraction[1];
+        const __m256 fb = fraction[2];
+
+        // Sort the fractions and find the strides of the largest and smallest
+        const __m256 max = _mm256_max_ps(_mm256_max_ps(fr, fg), fb);
+        const __m256 min = _mm256_min_ps(_mm256_min_ps(fr, fg), fb);
+        const __m256 mid = _mm256_max_ps(_mm256_min_ps(fr, fg),
+                                         _mm256_min_ps(_mm256_max_ps(fr, fg), fb));
+        const __m256i redMax = _mm256_castps_si256(_mm256_and_ps(
+            _mm256_cmp_ps(fr, fg, _CMP_GE_OQ), _mm256_cmp_ps(fr, fb, _CMP_GE_OQ)));
+        const __m256i greenMax = _mm256_castps_si256(_mm256_cmp_ps(fg, fb, _CMP_GE_OQ));
+        const __m256i redMin = _mm256_castps_si256(_mm256_and_ps(
+            _mm256_cmp_ps(fr, fg, _CMP_LE_OQ), _mm256_cmp_ps(fr, fb, _CMP_LE_OQ)));
+        const __m256i greenMin = _mm256_castps_si256(_mm256_cmp_ps(fg, fb, _CMP_LE_OQ));
+        const __m256i first = _mm256_blendv_epi8(
+            _mm256_blendv_epi8(kBlue, kGreen, greenMax), kRed, redMax);
+        const __m256i smallest = _mm256_blendv_epi8(
+            _mm256_blendv_epi8(kBlue, kGreen, greenMin), kRed, redMin);
+
+        __m256i corner[4];
+        corner[0] = _mm256_add_epi32(_mm256_add_epi32(
+            _mm256_mullo_epi32(index[0], kRed), _mm256_mullo_epi32(index[1], kGreen)),
+            _mm256_mullo_epi32(index[2], kBlue));
+        corner[1] = _mm256_add_epi32(corner[0], first);
+        corner[2] = _mm256_add_epi32(corner[0], _mm256_sub_epi32(kStrides, smallest));
+        corner[3] = _mm256_add_epi32(corner[0], kStrides);
+        const __m256 weight[4] = {
+            _mm256_sub_ps(kOne, max),
+            _mm256_sub_ps(max, mid),
+            _mm256_sub_ps(mid, min),
+            min
+        };
+
+        __m256 color[3] = {
+            _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()
+        };
+        for (int i = 0; i < 4; i++) {
+            __m256i texel[3];
+            if (sizeof(T) == 1) {
+                const __m256i rgbx = _mm256_i32gather_epi32((const int *)lattice, corner[i], 1);
+                texel[0] = _mm256_and_si256(rgbx, kByte);
+                texel[1] = _mm256_and_si256(_mm256_srli_epi32(rgbx, 8), kByte);
+                texel[2] = _mm256_and_si256(_mm256_srli_epi32(rgbx, 16), kByte);
+            } else {
+                const __m256i rg = _mm256_i32gather_epi32((const int *)lattice, corner[i], 2);
+                const __m256i bx = _mm256_i32gather_epi32((const int *)(lattice + 2), corner[i], 2);
+                texel[0] = _mm256_and_si256(rg, kWord);
+                texel[1] = _mm256_srli_epi32(rg, 16);
+                texel[2] = _mm256_and_si256(bx, kWord);
+            }
+            for (int j = 0; j < 3; j++)
+                color[j] = _mm256_add_ps(color[j],
+                    _mm256_mul_ps(weight[i], _mm256_cvtepi32_ps(texel[j])));
+        }
+
+        // Round and pack back into 8-bit RGB
+        __m256i result = _mm256_setzero_si256();
+        for (int j = 0; j < 3; j++) {
+            const __m256i c = _mm256_cvttps_epi32(
+                _mm256_add_ps(_mm256_mul_ps(color[j], kUnorm), kHalf));
+            result = _mm256_or_si256(result, _mm256_slli_epi32(c, 8*j));
+        }
+        result = _mm256_shuffle_epi8(result, kPack);
+        const __m128i lo = _mm256_castsi256_si128(result);
+        const __m128i hi = _mm256_extracti128_si256(result, 1);
+        uint8_t *const d = &out[x*3];
+        _mm_storeu_si128((__m128i *)d, lo);
+        _mm_storel_epi64((__m128i *)(d + 12), hi);
+        const int tail = _mm_extract_epi32(hi, 2);
+        memcpy(d + 20, &tail, sizeof tail);
+    }
+#endif
+    for (; x < end; x++) {
+        const uint8_t *const pixel = &rgb[x*3];
+        int index[3];
+        float fraction[3];
+        for (int i = 0; i < 3; i++) {
+            const float f = pixel[i] * scale;
+            index[i] = u::min(int(f), last);
+            fraction[i] = f - float(index[i]);
+        }
+        const float fr = fraction[0];
+        const float fg = fraction[1];
+        const float fb = fraction[2];
+
+        const float max = u::max(u::max(fr, fg), fb);
+        const float min = u::min(u::min(fr, fg), fb);
+        const float mid = u::max(u::min(fr, fg), u::min(u::max(fr, fg), fb));
+        const int first = (fr >= fg && fr >= fb) ? sr : (fg >= fb ? sg : sb);
+        const int smallest = (fr <= fg && fr <= fb) ? sr : (fg <= fb ? sg : sb);
+
+        const T *const corner = lattice + index[0]*sr + index[1]*sg + index[2]*sb;
+        const T *const c0 = corner;
+        const T *const c1 = corner + first;
+        const T *const c2 = corner + sr + sg + sb - smallest;
+        const T *const c3 = corner + sr + sg + sb;
+        const float w0 = 1.0f - max;
+        const float w1 = max - mid;
+        const float w2 = mid - min;
+        const float w3 = min;
+        for (int j = 0; j < 3; j++) {
+            float color = 0.0f;
+            color += w0 * float(c0[j]);
+            color += w1 * float(c1[j]);
+            color += w2 * float(c2[j]);
+            color += w3 * float(c3[j]);
+            out[x*3 + j] = uint8_t(color * unorm + 0.5f);
+        }
+    }
+}
+
+template <typename T>
+void grader::applyPixels(const T *lattice, const uint8_t *rgb, uint8_t *out,
+    size_t pixels) const
+{
+    // Split into runs of whole 8 pixel blocks for the threads, the calling
+    // thread does the first run.
+    const size_t threads = u::max(u::min(m_threads, pixels / 8), size_t(1));
+    const size_t run = ((pixels + threads - 1) / threads + 7) & ~size_t(7);
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++) {
+        const size_t begin = i * run;
+        const size_t end = u::min(begin + run, pixels);
+        if (begin < end)
+            pool.emplace_back([=]() { applyPixels(lattice, rgb, out, begin, end); });
+    }
+    applyPixels(lattice, rgb, out, 0, u::min(run, pixels));
+    for (auto &it : pool)
+        it.join();
+}
+
+void grader::apply(const uint8_t *rgb, uint8_t *out, size_t pixels) const {
+    switch (m_format) {
+    case kFormatRGB8:
+        applyPixels(&m_data[0], rgb, out, pixels);
+        break;
+    case kFormatRGB16:
+        applyPixels((const uint16_t *)&m_data[0], rgb, out, pixels);
+        break;
+    case kFormatRGB16F:
+        applyPixels(&m_lattice[0], rgb, out, pixels);
+        break;
     }
-    brightnessContrast();
 }
 
 void grader::setLuma(bool keep) {
@@ -389,6 +1170,126 @@ double grader::YB(int what) const {
     return m_balance[2][what];
 }
 
+void grader::setThreads(size_t threads) {
+    m_threads = threads ? threads : 1;
+}
+
+size_t grader::threads() const {
+    return m_threads;
+}
+
+size_t grader::size() const {
+    return m_size;
+}
+
+int grader::format() const {
+    return m_format;
+}
+
+size_t grader::bytes() const {
+    return m_width * m_height * 3 * (m_format == kFormatRGB8 ? 1 : 2);
+}
+
 const unsigned char *grader::data() const {
-    return m_data;
+    return &m_data[0];
+}
+
+#ifdef COLOR_GRADER_TEST
+#include <stdio.h>
+
+// The fixed point color space conversions have to give exactly the same
+// results as the double versions for every 8-bit input.
+struct conversionTest : grader {
+    static void run(size_t &cases, size_t &failures) {
+        for (int x = 0; x < 256; x++) {
+            for (int y = 0; y < 256; y++) {
+                for (int z = 0; z < 256; z++) {
+                    int fixed[3] = { x, y, z };
+                    int exact[3] = { x, y, z };
+                    RGB2HSLFixed(fixed[0], fixed[1], fixed[2]);
+                    RGB2HSLDouble(exact[0], exact[1], exact[2]);
+                    failures += memcmp(fixed, exact, sizeof fixed) != 0;
+
+                    fixed[0] = exact[0] = x;
+                    fixed[1] = exact[1] = y;
+                    fixed[2] = exact[2] = z;
+                    HSL2RGBFixed(fixed[0], fixed[1], fixed[2]);
+                    HSL2RGBDouble(exact[0], exact[1], exact[2]);
+                    failures += memcmp(fixed, exact, sizeof fixed) != 0;
+
+                    failures += RGB2LFixed(x, y, z) != RGB2LDouble(x, y, z);
+                    cases += 3;
+                }
+            }
+        }
+    }
+};
+
+int main() {
+    size_t cases = 0;
+    size_t failures = 0;
+    conversionTest::run(cases, failures);
+    printf("%zu cases, %zu failures\n", cases, failures);
+    return failures != 0;
+}
+#endif
+
+#ifdef COLOR_GRADER_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+
+int main() {
+    static const size_t kSizes[] = { 17, 33, 65 };
+    static const char *kFormats[] = { "RGB8", "RGB16", "RGB16F" };
+    const size_t pixels = 1920 * 1080;
+    std::vector<uint8_t> image(pixels * 3);
+    std::vector<uint8_t> graded(pixels * 3);
+    for (auto &it : image)
+        it = rand() & 0xFF;
+
+    const size_t threads = u::max(size_t(std::thread::hardware_concurrency()), size_t(1));
+    for (size_t size : kSizes) {
+        for (int format = grader::kFormatRGB8; format <= grader::kFormatRGB16F; format++) {
+            grader g(size, format);
+            g.setCR(0.5, grader::kBalanceMidtones);
+            g.setBrightness(0.1);
+            g.setContrast(0.2);
+            // Grade only reruns the stages whose inputs changed, the color
+            // balance is nudged every time so the whole pipeline is timed.
+            for (int luma = 0; luma <= 1; luma++) {
+                g.setLuma(luma);
+                for (size_t count = 1; count <= threads; count *= 2) {
+                    g.setThreads(count);
+                    size_t luts = 0;
+                    const auto start = std::chrono::steady_clock::now();
+                    std::chrono::duration<double> elapsed;
+                    do {
+                        g.setCR((luts & 1) ? 0.5 : 0.25, grader::kBalanceMidtones);
+                        g.grade();
+                        luts++;
+                        elapsed = std::chrono::steady_clock::now() - start;
+                    } while (elapsed.count() < 1.0);
+                    printf("%zu^3 %-6s %2zu threads: %8.2f LUTs/s (luma %s)\n", size,
+                        kFormats[format], count, luts / elapsed.count(), luma ? "on" : "off");
+                }
+            }
+            g.setThreads(threads);
+            g.grade();
+            for (size_t count = 1; count <= threads; count *= 2) {
+                g.setThreads(count);
+                size_t frames = 0;
+                const auto start = std::chrono::steady_clock::now();
+                std::chrono::duration<double> elapsed;
+                do {
+                    g.apply(&image[0], &graded[0], pixels);
+                    frames++;
+                    elapsed = std::chrono::steady_clock::now() - start;
+                } while (elapsed.count() < 1.0);
+                printf("%zu^3 %-6s %2zu threads: %8.2f MP/s\n", size, kFormats[format],
+                    count, frames * pixels / elapsed.count() / 1e6);
+            }
+        }
+    }
 }
+#endif
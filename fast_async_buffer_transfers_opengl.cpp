@@ -1,10 +1,162 @@
 #ifndef R_BUFFER_HDR
 #define R_BUFFER_HDR
+#include <chrono>
+
 #include "r_common.h"
 #include "u_vector.h"
 
 namespace r {
 
+// The staging core below keeps track of the ring of regions, the changed ranges
+// and when to wait. Everything else is left to a backend: the graphics API for
+// rendering or a mock for testing. Regions are identified by their index.
+struct stagingBackend {
+    enum waitResult {
+        kUnfenced, // The region was never fenced
+        kSignaled, // The fence was already signaled
+        kBlocked   // Had to block until the fence signaled
+    };
+
+    virtual ~stagingBackend() { }
+    // Allocate `count' regions of `size' bytes
+    virtual void init(size_t size, size_t count) = 0;
+    // Change the amount of regions to `count' once none of them are in use
+    // any longer, their contents are lost
+    virtual void resize(size_t count) = 0;
+    // Map region `index' for writing and return the mapping
+    virtual unsigned char *map(size_t index) = 0;
+    // Make the `count' bytes at `offset' written in region `index' visible
+    virtual void flush(size_t index, size_t offset, size_t count) = 0;
+    // Done writing to region `index' until it's mapped again
+    virtual void unmap(size_t index) = 0;
+    // Insert a fence after the commands which use region `index'
+    virtual void fence(size_t index) = 0;
+    // Wait for the fence of region `index'
+    virtual waitResult wait(size_t index) = 0;
+    // Whether writes are visible without flushes
+    virtual bool coherent() const = 0;
+    // Byte offset of region `index' in what the GPU sources from
+    virtual size_t offset(size_t index) const = 0;
+};
+
+struct staging {
+    staging(stagingBackend *backend, size_t size, size_t count = 3);
+    // Copies would share the backend and the mapping, and the buffer objects
+    // of a GL backend would be deleted twice.
+    staging(const staging &) = delete;
+    staging &operator=(const staging &) = delete;
+    void init();
+
+    // To control buffer index and mapping, we need to do manipulation within
+    // a buffer scope which is indicated by a pair of the following functions.
+    void beginChanges();
+    void endChanges();
+    // Similarly, after we've drawn with the buffer, we must post the changes
+    // so that a fence can be inserted into the command queue indicatinh that the
+    // fenced data is used in a draw operation
+    void postChanges();
+
+    // Write `data' of length `size' bytes at `offset' into the buffer.
+    void write(const void *const data, size_t size, size_t offset);
+
+    // Write `count' contiguous elements of `size' bytes from `data' at
+    // `offset' into the buffer. Unlike a write per element this is a single
+    // copy and a single flush record.
+    void writeRange(const void *const data, size_t size, size_t count, size_t offset);
+
+    // Write `size' bytes of `count' elements which are `stride' bytes apart in
+    // `data' packed together at `offset' into the buffer. Used to pull a single
+    // attribute (like the position) out of an array of structures. A `stride'
+    // of zero repeats the first element `count' times.
+    void writeStrided(const void *const data, size_t size, size_t stride,
+                      size_t count, size_t offset);
+
+    // Reserve `size' bytes after everything written since beginChanges and
+    // return a pointer to them in the mapping, so vertices can be built in place
+    // without a copy. The pointer is rounded up to `alignment', a power of two,
+    // so it can be cast to the vertex type after writes of any size. The offset
+    // of the reservation is stored in `offset' when given. Returns nullptr if
+    // the buffer does not have room.
+    unsigned char *reserve(size_t size, size_t *offset = nullptr, size_t alignment = 16);
+
+    // Byte offset of the region being changed within the bound buffer object.
+    // With GL this is always zero unless the buffer is persistently mapped.
+    size_t offset() const;
+
+    // Changed ranges less than or equal to `gap' bytes apart are flushed as
+    // one, flushing the untouched bytes in between is often cheaper than
+    // another call into the driver. Defaults to zero: only overlapping and
+    // adjacent ranges are joined.
+    void setFlushGap(size_t gap);
+
+    // When a frame waits longer than `threshold' in beginChanges, add another
+    // region to the ring, up to `maxCount' regions. This waits for all the
+    // regions to be unused once, so it's a hitch at first to prevent more.
+    void setAdaptive(std::chrono::microseconds threshold, size_t maxCount = 8);
+
+    // Amount of regions in the ring
+    size_t count() const;
+
+    struct stats {
+        stats();
+        stats &operator+=(const stats &other);
+        // Writes per flush call, zero if nothing was flushed
+        double coalescing() const;
+
+        size_t frames;
+        // Outcome of the wait in beginChanges, they add up to `frames'
+        size_t unfenced;
+        size_t signaled;
+        size_t stalls;
+        // Time spent in beginChanges waiting for the GPU
+        std::chrono::nanoseconds waitTime;
+        size_t bytesWritten;
+        // Calls to any of the writes (or reserve) and the flushes made for
+        // them after coalescing
+        size_t writes;
+        size_t flushes;
+        // Regions added to the ring by the adaptive mode
+        size_t grown;
+    };
+
+    // Statistics of the frame since the last beginChanges and since init (or
+    // the last resetStats)
+    stats frameStats() const;
+    stats totalStats() const;
+    void resetStats();
+
+    // Stores to the backing buffer data provided by MapBufferRange calls need
+    // explicit flushing of the changed sub-ranges. This is used to record those
+    // ranges, deferring the flushes as late as possible.
+    struct flushRecord { size_t offset, count; };
+
+    // Sorts `records' by offset and merges the ones which overlap or are at
+    // most `gap' bytes apart in a single pass, in place. Returns the amount of
+    // records left.
+    static size_t coalesce(flushRecord *records, size_t count, size_t gap);
+
+protected:
+    // Used to keep track of the bytes changed by any of the writes
+    void recordWrite(size_t offset, size_t size);
+private:
+    stagingBackend *m_backend;
+    unsigned char *m_mapping;
+
+    u::vector<flushRecord> m_flushRecords;
+    size_t m_flushGap;
+    // End of the furthest write since beginChanges, where reserve starts
+    size_t m_writeEnd;
+
+    size_t m_bufferSize;
+    size_t m_bufferCount;
+    size_t m_bufferIndex;
+
+    std::chrono::nanoseconds m_adaptiveThreshold;
+    size_t m_adaptiveCount;
+    stats m_frameStats;
+    stats m_totalStats;
+};
+
 // Implements a variety of asynchronous buffer transfer techniques depending on
 // the capabilities provided by the GPU.
 //
@@ -22,54 +174,73 @@ namespace r {
 //      Typically most operations on buffers are sub-range changes. Like writing
 //      a vertex. We manipulate the data store in ranges, keeping a record of the
 //      ranges modified so we can flush all the appropriate changes in chain. We
-//      also try to find overlapping range changes and coalesce them into a single
-//      flush if possible, reducing the amount of invocations to the driver.
+//      also coalesce overlapping and adjacent range changes into a single flush,
+//      reducing the amount of invocations to the driver. Ranges which are only
+//      a few bytes apart can be joined as well, see `setFlushGap'.
 //
 //  MapBufferRange:
 //      Mapping the memory into the client address space provides us with a raw
 //      backing store to perform operations on. This eliminates the need to do
 //      out-of-band copies into GPU memory.
 //
+//  GL_ARB_buffer_storage:
+//      When present (along with GL_ARB_sync) we allocate one immutable buffer
+//      object large enough for `count' regions of `size' bytes and map it once,
+//      persistently and coherently. The regions are used as a ring, each one
+//      guarded by its own fence. Nothing is mapped, unmapped or flushed in the
+//      frame loop; writes land directly in memory the GPU reads from. Since
+//      all regions live in the same buffer object, the draw must source from
+//      `offset()' into the bound buffer.
+//
 // glMapBuffer on it's own provides no control over synchronization. As a result
 // utilizing plain glBufferData copies provides similar performance characteristics
 // as glMapBuffer on most devices. Because of this we don't utilize glMapBuffer
 // at all and prefer the standard technique above all else.
-struct buffer {
-    buffer(size_t size, size_t count = 3);
-    ~buffer();
-    void init();
+struct glBackend : stagingBackend {
+    glBackend();
+    ~glBackend();
 
-    // To control buffer index and mapping, we need to do manipulation within
-    // a buffer scope which is indicated by a pair of the following functions.
-    void beginChanges();
-    void endChanges();
-    // Similarly, after we've drawn with the buffer, we must post the changes
-    // so that a fence can be inserted into the command queue indicatinh that the
-    // fenced data is used in a draw operation
-    void postChanges();
-
-    // Write `data' of length `size' bytes at `offset' into the buffer.
-    void write(unsigned char *data, size_t size, size_t offset);
+    void init(size_t size, size_t count) override;
+    void resize(size_t count) override;
+    unsigned char *map(size_t index) override;
+    void flush(size_t index, size_t offset, size_t count) override;
+    void unmap(size_t index) override;
+    void fence(size_t index) override;
+    waitResult wait(size_t index) override;
+    bool coherent() const override;
+    size_t offset(size_t index) const override;
 
 protected:
     // Used to create and delete a mapping
     void createMapping(size_t bufferIndex);
     void deleteMapping(size_t bufferIndex);
+    // Used to delete everything init created
+    void release();
 private:
-    // Stores to the backing buffer data provided by MapBufferRange calls need
-    // explicit flushing of the changed sub-ranges. This is used to record those
-    // ranges, deferring the flushes as late as possible.
-    struct flushRecord { size_t offset, count; };
-    u::vector<flushRecord> m_flushRecords;
+    // Regions of a persistent mapping start on this alignment which satisfies
+    // the offset alignment of any buffer binding point
+    static constexpr size_t kRegionAlignment = 256;
+    // One second, if a fence takes longer than this something has gone wrong
+    static constexpr GLuint64 kFenceTimeout = 1000000000;
 
     u::vector<GLuint> m_bufferObjects;
     u::vector<unsigned char *> m_bufferMappings;
     u::vector<GLsync> m_bufferFences;
     uint64_t m_bufferMappingBitset;
-
     size_t m_bufferSize;
     size_t m_bufferCount;
-    size_t m_bufferIndex;
+
+    // Persistent mapping with ARB_buffer_storage, in which case there is only
+    // one buffer object and `m_regionSize' is the distance between regions.
+    bool m_persistent;
+    size_t m_regionSize;
+};
+
+// The staging core on top of GL
+struct buffer : staging {
+    buffer(size_t size, size_t count = 3);
+private:
+    glBackend m_backend;
 };
 
 // Example use:
@@ -81,157 +252,961 @@ private:
 //           sizeof(m::vec3) * it);
 // }
 // b.endChanges();
+// gl::VertexAttribPointer(..., (const GLvoid *)b.offset());
 // gl::DrawElements(...);
 // b.postChanges();
 //
 
+// Stands in for the GPU so the staging core can be tested and benchmarked
+// without a context. Each fenced frame takes `latency' on the simulated GPU,
+// one after the other like a command queue, and waits sleep until the frame
+// is done. Unless coherent, only flushed bytes reach the device copy of a
+// region. Mapping a region the GPU is still using counts as a race.
+struct mockBackend : stagingBackend {
+    mockBackend(std::chrono::microseconds latency, bool coherent = false);
+
+    void init(size_t size, size_t count) override;
+    void resize(size_t count) override;
+    unsigned char *map(size_t index) override;
+    void flush(size_t index, size_t offset, size_t count) override;
+    void unmap(size_t index) override;
+    void fence(size_t index) override;
+    waitResult wait(size_t index) override;
+    bool coherent() const override;
+    size_t offset(size_t index) const override;
+
+    // What the GPU sees of region `index'
+    const unsigned char *device(size_t index) const;
+    size_t races() const;
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    clock::duration m_latency;
+    bool m_coherent;
+    size_t m_size;
+    u::vector<unsigned char> m_host;
+    u::vector<unsigned char> m_device;
+    // When the fence of each region signals, the epoch when it has none
+    u::vector<clock::time_point> m_fences;
+    // When the simulated GPU is done with all the queued frames
+    clock::time_point m_idle;
+    size_t m_races;
+};
+
 }
 
 #endif
 #include "r_buffer.h"
 
+#include <thread>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 namespace r {
 
-buffer::buffer(size_t size, size_t count)
-    : m_bufferSize(size)
+staging::staging(stagingBackend *backend, size_t size, size_t count)
+    : m_backend(backend)
+    , m_mapping(nullptr)
+    , m_flushGap(0)
+    , m_writeEnd(0)
+    , m_bufferSize(size)
     , m_bufferCount(count)
-    , m_bufferMappingBitset(0)
+    , m_bufferIndex(count - 1)
+    , m_adaptiveThreshold(0)
+    , m_adaptiveCount(0)
 {
-    // Only have so many bits to keep track of used buffer mappings
-    assert(count <= sizeof m_bufferMappingBitset * CHAR_BIT);
-    m_bufferObjects.resize(m_bufferCount);
-    m_bufferMappings.resize(m_bufferCount);
 }
 
-buffer::~buffer() {
-    if (gl::has(gl::ARB_map_buffer_range)) {
-        if (gl::has(gl::ARB_sync))
-            for (size_t i = 0; i < m_bufferFences.size(); i++)
-                if (m_bufferFences[i])
-                    gl::DeleteSync(it);
+staging::stats::stats()
+    : frames(0)
+    , unfenced(0)
+    , signaled(0)
+    , stalls(0)
+    , waitTime(0)
+    , bytesWritten(0)
+    , writes(0)
+    , flushes(0)
+    , grown(0)
+{
+}
+
+staging::stats &staging::stats::operator+=(const stats &other) {
+    frames += other.frames;
+    unfenced += other.unfenced;
+    signaled += other.signaled;
+    stalls += other.stalls;
+    waitTime += other.waitTime;
+    bytesWritten += other.bytesWritten;
+    writes += other.writes;
+    flushes += other.flushes;
+    grown += other.grown;
+    return *this;
+}
+
+double staging::stats::coalescing() const {
+    return flushes ? double(writes) / flushes : 0.0;
+}
+
+void staging::init() {
+    m_backend->init(m_bufferSize, m_bufferCount);
+}
+
+void staging::beginChanges() {
+    m_totalStats += m_frameStats;
+    m_frameStats = stats();
+    m_frameStats.frames = 1;
+
+    m_bufferIndex = (m_bufferIndex + 1) % m_bufferCount;
+    m_writeEnd = 0;
+    // Wait until the region is free to use, in most cases this should not
+    // wait because we are using `m_bufferCount' regions in a chain.
+    const auto start = std::chrono::steady_clock::now();
+    switch (m_backend->wait(m_bufferIndex)) {
+    case stagingBackend::kUnfenced:
+        m_frameStats.unfenced++;
+        break;
+    case stagingBackend::kSignaled:
+        m_frameStats.signaled++;
+        break;
+    case stagingBackend::kBlocked:
+        m_frameStats.stalls++;
+        break;
+    }
+    // Waits this long will keep happening if the GPU is that far behind, give
+    // it another frame of slack.
+    if (m_frameStats.stalls && m_bufferCount < m_adaptiveCount
+        && std::chrono::steady_clock::now() - start > m_adaptiveThreshold)
+    {
+        for (size_t i = 0; i < m_bufferCount; i++)
+            m_backend->wait(i);
+        m_backend->resize(++m_bufferCount);
+        m_bufferIndex = 0;
+        m_frameStats.grown++;
+    }
+    m_frameStats.waitTime = std::chrono::steady_clock::now() - start;
+    m_mapping = m_backend->map(m_bufferIndex);
+}
+
+void staging::endChanges() {
+    // Coherent writes are visible to the GPU without being flushed
+    if (!m_backend->coherent() && !m_flushRecords.empty()) {
+        // Coalesce flush records to reduce the amount of driver invocations
+        m_flushRecords.resize(coalesce(&m_flushRecords[0], m_flushRecords.size(), m_flushGap));
+        for (auto &it : m_flushRecords)
+            m_backend->flush(m_bufferIndex, it.offset, it.count);
+        m_frameStats.flushes += m_flushRecords.size();
+    }
+    m_flushRecords.clear();
+    m_backend->unmap(m_bufferIndex);
+}
+
+void staging::postChanges() {
+    // Insert a fence into the command queue. The next use of this buffer will
+    // have to wait for the commands to be complete.
+    m_backend->fence(m_bufferIndex);
+}
+
+void staging::write(const void *const data, size_t size, size_t offset) {
+    // Write the data
+    unsigned char *destHead = m_mapping;
+    const unsigned char *const destTail = destHead + m_bufferSize;
+    assert(destHead + offset + size <= destTail);
+    memcpy(destHead + offset, data, size);
+    recordWrite(offset, size);
+}
+
+void staging::writeRange(const void *const data, size_t size, size_t count, size_t offset) {
+    write(data, size * count, offset);
+}
+
+void staging::writeStrided(const void *const data, size_t size, size_t stride,
+                           size_t count, size_t offset)
+{
+    if (stride == size || count == 0)
+        return writeRange(data, size, count, offset);
+    unsigned char *destHead = m_mapping;
+    const unsigned char *const destTail = destHead + m_bufferSize;
+    assert(destHead + offset + size * count <= destTail);
+    unsigned char *dest = destHead + offset;
+    const unsigned char *source = (const unsigned char *)data;
+    size_t i = 0;
+#ifdef __SSE2__
+    // Elements of up to 16 bytes are moved with one unaligned load and store
+    // each. The store writes past the element but the next one overwrites
+    // that, so only stop while the load and store stay inside of the source
+    // and destination. A zero stride is left to the copies below.
+    if (stride && size <= 16 && size * count >= 16 && stride * (count - 1) + size >= 16) {
+        const size_t destCount = (size * count - 16) / size + 1;
+        const size_t sourceCount = (stride * (count - 1) + size - 16) / stride + 1;
+        const size_t simdCount = u::min(destCount, sourceCount);
+        for (; i < simdCount; i++) {
+            const __m128i element = _mm_loadu_si128((const __m128i *)(source + stride * i));
+            _mm_storeu_si128((__m128i *)(dest + size * i), element);
+        }
+    }
+#endif
+    for (; i < count; i++)
+        memcpy(dest + size * i, source + stride * i, size);
+    recordWrite(offset, size * count);
+}
+
+unsigned char *staging::reserve(size_t size, size_t *offset, size_t alignment) {
+    assert(alignment && (alignment & (alignment - 1)) == 0);
+    const size_t padding = -uintptr_t(m_mapping + m_writeEnd) & (alignment - 1);
+    const size_t start = m_writeEnd + padding;
+    if (start + size > m_bufferSize)
+        return nullptr;
+    if (offset)
+        *offset = start;
+    unsigned char *const reservation = m_mapping + start;
+    recordWrite(start, size);
+    return reservation;
+}
+
+void staging::recordWrite(size_t offset, size_t size) {
+    m_frameStats.bytesWritten += size;
+    m_frameStats.writes++;
+    m_writeEnd = u::max(m_writeEnd, offset + size);
+    // Nothing needs flushing in a coherent mapping
+    if (!m_backend->coherent())
+        m_flushRecords.push_back({ offset, size });
+}
+
+size_t staging::offset() const {
+    return m_backend->offset(m_bufferIndex);
+}
+
+void staging::setFlushGap(size_t gap) {
+    m_flushGap = gap;
+}
+
+void staging::setAdaptive(std::chrono::microseconds threshold, size_t maxCount) {
+    m_adaptiveThreshold = threshold;
+    m_adaptiveCount = maxCount;
+}
+
+size_t staging::count() const {
+    return m_bufferCount;
+}
+
+staging::stats staging::frameStats() const {
+    return m_frameStats;
+}
+
+staging::stats staging::totalStats() const {
+    stats total = m_totalStats;
+    return total += m_frameStats;
+}
+
+void staging::resetStats() {
+    m_frameStats = stats();
+    m_totalStats = stats();
+}
+
+size_t staging::coalesce(flushRecord *records, size_t count, size_t gap) {
+    if (count == 0)
+        return 0;
+    // Writes tend to happen in order, like the per-particle loop in the
+    // example, so only sort when they did not.
+    for (size_t i = 1; i < count; i++) {
+        if (records[i].offset < records[i - 1].offset) {
+            u::sort(records, records + count,
+                [](const flushRecord &a, const flushRecord &b) {
+                    return a.offset < b.offset;
+                });
+            break;
+        }
+    }
+    // Grow the last merged record while the next one starts inside of it or
+    // within `gap' bytes of its end, otherwise the next one starts a new record.
+    size_t merged = 0;
+    size_t end = records[0].offset + records[0].count;
+    for (size_t i = 1; i < count; i++) {
+        const flushRecord &currentRecord = records[i];
+        if (currentRecord.offset <= end + gap) {
+            end = u::max(end, currentRecord.offset + currentRecord.count);
+        } else {
+            records[merged].count = end - records[merged].offset;
+            records[++merged] = currentRecord;
+            end = currentRecord.offset + currentRecord.count;
+        }
+    }
+    records[merged].count = end - records[merged].offset;
+    return merged + 1;
+}
+
+glBackend::glBackend()
+    : m_bufferMappingBitset(0)
+    , m_bufferSize(0)
+    , m_bufferCount(0)
+    , m_persistent(false)
+    , m_regionSize(0)
+{
+}
+
+glBackend::~glBackend() {
+    release();
+}
+
+void glBackend::release() {
+    if (m_bufferObjects.empty())
+        return;
+    if (gl::has(gl::ARB_sync))
+        for (auto &it : m_bufferFences)
+            if (it)
+                gl::DeleteSync(it);
+    if (m_persistent) {
+        // The one mapping is only released with the buffer object
+        gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[0]);
+        gl::UnmapBuffer(GL_ARRAY_BUFFER);
+    } else if (gl::has(gl::ARB_map_buffer_range)) {
         for (size_t i = 0; i < m_bufferMappings.size(); i++)
-            deleteMapping(i);
+            if (m_bufferMappingBitset & (uint64_t(1) << i))
+                deleteMapping(i);
     } else {
         for (size_t i = 0; i < m_bufferMappings.size(); i++)
             neoFree(m_bufferMappings[i]);
     }
-    gl::DeleteBuffers(m_bufferCount, &m_bufferObjects[0]);
+    gl::DeleteBuffers(m_bufferObjects.size(), &m_bufferObjects[0]);
+    m_bufferObjects.clear();
+    m_bufferMappings.clear();
+    m_bufferFences.clear();
+    m_bufferMappingBitset = 0;
 }
 
-void buffer::createMapping(size_t bufferIndex) {
+void glBackend::createMapping(size_t bufferIndex) {
     // Create a mapping for writing to only, hinting the driver that
     // we're responsible for flushing the writes and that we want the
     // driver to invalidate previous contents (we reuse these mappings.)
     // If ARB_sync is present, we also hint that we'd prefer to do
     // synchronization ourselfs.
-    m_bufferMappings[bufferIndex] =
+    gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[bufferIndex]);
+    m_bufferMappings[bufferIndex] = (unsigned char *)
         gl::MapBufferRange(GL_ARRAY_BUFFER,
                            0,
-                           m_size,
+                           m_bufferSize,
                            GL_MAP_WRITE_BIT |
                            GL_MAP_FLUSH_EXPLICIT_BIT |
                            GL_MAP_INVALIDATE_RANGE_BIT |
                            (gl::has(gl::ARB_sync)
-                                ? GL_MAP_UNSYNCRONIZED_BIT
+                                ? GL_MAP_UNSYNCHRONIZED_BIT
                                 : 0));
-    m_bufferMappingBitset |= (1 << bufferIndex);
+    m_bufferMappingBitset |= (uint64_t(1) << bufferIndex);
 }
 
-void buffer::deleteMapping(size_t bufferIndex) {
-    gl::UnmapBuffer(m_bufferMappings[bufferIndex]);
-    m_bufferMappingBitset &= ~(1 << bufferIndex);
+void glBackend::deleteMapping(size_t bufferIndex) {
+    gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[bufferIndex]);
+    gl::UnmapBuffer(GL_ARRAY_BUFFER);
+    m_bufferMappingBitset &= ~(uint64_t(1) << bufferIndex);
 }
 
-void buffer::init() {
+void glBackend::init(size_t size, size_t count) {
+    // Only have so many bits to keep track of used buffer mappings
+    assert(count <= sizeof m_bufferMappingBitset * CHAR_BIT);
+    m_bufferSize = size;
+    m_bufferCount = count;
+    m_regionSize = size;
+    m_bufferObjects.resize(count);
+    m_bufferMappings.resize(count);
     const bool manualSyncronization = gl::has(gl::ARB_sync);
-    gl::GenBuffers(&m_bufferObjects[0], m_bufferCount);
+    // Upfront allocate fence objects if we're doing synchronization ourselfs.
+    if (manualSyncronization)
+        m_bufferFences.resize(count);
+    // The ring of regions in a persistent mapping relies on fences to know
+    // when a region can be reused.
+    m_persistent = manualSyncronization && gl::has(gl::ARB_buffer_storage);
+    if (m_persistent) {
+        const GLbitfield flags = GL_MAP_WRITE_BIT |
+                                 GL_MAP_PERSISTENT_BIT |
+                                 GL_MAP_COHERENT_BIT;
+        m_regionSize = (m_bufferSize + kRegionAlignment - 1) & ~(kRegionAlignment - 1);
+        m_bufferObjects.resize(1);
+        gl::GenBuffers(1, &m_bufferObjects[0]);
+        gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[0]);
+        gl::BufferStorage(GL_ARRAY_BUFFER, m_regionSize * count, nullptr, flags);
+        unsigned char *const mapping = (unsigned char *)
+            gl::MapBufferRange(GL_ARRAY_BUFFER, 0, m_regionSize * count, flags);
+        for (size_t i = 0; i < count; i++)
+            m_bufferMappings[i] = mapping + m_regionSize * i;
+        return;
+    }
+    gl::GenBuffers(count, &m_bufferObjects[0]);
     if (gl::has(gl::ARB_map_buffer_range)) {
+        // The data store needs to exist before it can be mapped
         for (size_t i = 0; i < m_bufferObjects.size(); i++) {
             gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[i]);
+            gl::BufferData(GL_ARRAY_BUFFER, m_bufferSize, nullptr, GL_DYNAMIC_DRAW);
             createMapping(i);
         }
-        // Upfront allocate fence objects if we're doing synchronization ourselfs.
-        if (manualSyncronization)
-            m_bufferFences.resize(m_bufferCount);
     } else {
         // If the extension is not present, we fallback to standard ping pong
         // technique and do an out-of-band copy of the data.
         for (size_t i = 0; i < m_bufferMappings.size(); i++) {
-            m_bufferMappings[i] = neoMalloc(m_bufferSize);
+            m_bufferMappings[i] = (unsigned char *)neoMalloc(m_bufferSize);
             gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[i]);
-            gl::BufferData(GL_ARRAY_BUFFER, m_bufferSize, 0, GL_DYNAMIC_DRAW);
+            gl::BufferData(GL_ARRAY_BUFFER, m_bufferSize, nullptr, GL_DYNAMIC_DRAW);
         }
     }
 }
 
-void buffer::beginChanges() {
-    m_bufferIndex = m_bufferIndex++ % m_bufferCount;
-    const bool manualSyncronization = gl::has(gl::ARB_sync);
-    if (manualSyncronization) {
-        // Wait until buffer is free to use, in most cases this should not wait
-        // because we are using `m_bufferCount' buffers in a chain.
-        GLenum result = gl::ClientWaitSync(m_fences[m_bufferIndex], 0, TIMEOUT);
-        assert(result != GL_TIMEOUT_EXPIRED);
-        assert(result != GL_WAIT_FAILED);
-        gl::DeleteSync(m_bufferFences[m_bufferIndex]);
-    }
-    gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[m_bufferIndex]);
+void glBackend::resize(size_t count) {
+    // Every fence has been waited on, none of the buffers are in use
+    release();
+    init(m_bufferSize, count);
+}
+
+unsigned char *glBackend::map(size_t index) {
+    if (m_persistent) {
+        // Nothing to map, the region is ready for writing once its fence
+        // has signaled.
+        gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[0]);
+        return m_bufferMappings[index];
+    }
+    gl::BindBuffer(GL_ARRAY_BUFFER, m_bufferObjects[index]);
     if (gl::has(gl::ARB_map_buffer_range)) {
         // If the buffer is no longer mapped, map it in
-        if (!(m_bufferMappingBitset & (1 << m_bufferIndex)))
-            createMapping(m_bufferIndex);
-    }
-}
-
-void buffer::endChanges() {
-    // Sort the flush records by offset
-    u::sort(m_flushRecords.begin(), m_flushRecords.end(),
-        [](const flushRecord &a, const flushRecord &b) {
-            return a.offset < b.offset;
-        });
-    // Coalesce flush records to reduce the amount of driver invocations
-    flushRecord &previousRecord = m_flushRecords[0];
-    for (size_t i = 1; i < m_flushRecords.size(); i++) {
-        flushRecord &currentRecord = m_flushRecords[i];
-        if (currentRecord.offset == previousRecord.offset+previousRecord.count) {
-            const size_t newRange = currentRecord.count - currentRecord.offset;
-            // Erase the flush record and adjust the count of the previous
-            // record so it reaches into the current record.
-            m_flushRecords.erase(m_flushRecords.begin() + i,
-                                 m_flushRecords.begin() + i + 1);
-            m_previousRecord.count = newRange;
+        if (!(m_bufferMappingBitset & (uint64_t(1) << index)))
+            createMapping(index);
+    }
+    return m_bufferMappings[index];
+}
+
+void glBackend::flush(size_t index, size_t offset, size_t count) {
+    if (gl::has(gl::ARB_map_buffer_range))
+        gl::FlushMappedBufferRange(GL_ARRAY_BUFFER, offset, count);
+    else
+        gl::BufferSubData(GL_ARRAY_BUFFER, offset, count, m_bufferMappings[index] + offset);
+}
+
+void glBackend::unmap(size_t index) {
+    if (!m_persistent && gl::has(gl::ARB_map_buffer_range))
+        deleteMapping(index);
+}
+
+void glBackend::fence(size_t index) {
+    if (gl::has(gl::ARB_sync))
+        m_bufferFences[index] = gl::FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+stagingBackend::waitResult glBackend::wait(size_t index) {
+    if (!gl::has(gl::ARB_sync))
+        return kUnfenced;
+    GLsync &fence = m_bufferFences[index];
+    if (!fence)
+        return kUnfenced;
+    GLenum result = gl::ClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, kFenceTimeout);
+    assert(result != GL_TIMEOUT_EXPIRED);
+    assert(result != GL_WAIT_FAILED);
+    gl::DeleteSync(fence);
+    fence = 0;
+    return result == GL_ALREADY_SIGNALED ? kSignaled : kBlocked;
+}
+
+bool glBackend::coherent() const {
+    return m_persistent;
+}
+
+size_t glBackend::offset(size_t index) const {
+    return m_persistent ? m_regionSize * index : 0;
+}
+
+buffer::buffer(size_t size, size_t count)
+    : staging(&m_backend, size, count)
+{
+}
+
+mockBackend::mockBackend(std::chrono::microseconds latency, bool coherent)
+    : m_latency(latency)
+    , m_coherent(coherent)
+    , m_size(0)
+    , m_races(0)
+{
+}
+
+void mockBackend::init(size_t size, size_t count) {
+    m_size = size;
+    m_host.resize(size * count);
+    m_device.resize(size * count);
+    m_fences.resize(count);
+}
+
+void mockBackend::resize(size_t count) {
+    for (auto &it : m_fences)
+        if (clock::now() < it)
+            m_races++;
+    m_fences.assign(count, clock::time_point());
+    init(m_size, count);
+}
+
+unsigned char *mockBackend::map(size_t index) {
+    if (clock::now() < m_fences[index])
+        m_races++;
+    return m_coherent ? &m_device[m_size * index] : &m_host[m_size * index];
+}
+
+void mockBackend::flush(size_t index, size_t offset, size_t count) {
+    assert(offset + count <= m_size);
+    memcpy(&m_device[m_size * index + offset], &m_host[m_size * index + offset], count);
+}
+
+void mockBackend::unmap(size_t) {
+    // Nothing to do
+}
+
+void mockBackend::fence(size_t index) {
+    // The frame starts on the GPU once the previous ones are done
+    m_idle = u::max(m_idle, clock::now()) + m_latency;
+    m_fences[index] = m_idle;
+}
+
+stagingBackend::waitResult mockBackend::wait(size_t index) {
+    const clock::time_point signal = m_fences[index];
+    m_fences[index] = clock::time_point();
+    if (signal == clock::time_point())
+        return kUnfenced;
+    if (clock::now() >= signal)
+        return kSignaled;
+    std::this_thread::sleep_until(signal);
+    return kBlocked;
+}
+
+bool mockBackend::coherent() const {
+    return m_coherent;
+}
+
+size_t mockBackend::offset(size_t index) const {
+    return m_size * index;
+}
+
+const unsigned char *mockBackend::device(size_t index) const {
+    return &m_device[m_size * index];
+}
+
+size_t mockBackend::races() const {
+    return m_races;
+}
+
+}
+
+#ifdef R_BUFFER_TEST
+#include <stdio.h>
+#include <stdlib.h>
+
+// Checks the coalesced flush records against a byte map of the writes: every
+// written byte is still flushed, records are in order and more than `gap'
+// bytes apart, and every record starts and ends on written bytes.
+static void testCoalesce(size_t &cases, size_t &failures) {
+    const size_t kSize = 4096;
+    for (size_t gap = 0; gap <= 16; gap += 4) {
+        for (size_t n = 0; n < 10000; n++) {
+            u::vector<r::buffer::flushRecord> records(1 + rand() % 64);
+            u::vector<unsigned char> written(kSize);
+            for (auto &it : records) {
+                it.count = 1 + rand() % (n % 2 ? 16 : 256);
+                it.offset = rand() % (kSize - it.count);
+                memset(&written[it.offset], 1, it.count);
+            }
+            // Half of the cases are sorted like in order writes would be
+            if (n % 4 == 0)
+                u::sort(records.begin(), records.end(),
+                    [](const r::buffer::flushRecord &a, const r::buffer::flushRecord &b) {
+                        return a.offset < b.offset;
+                    });
+            const size_t count = r::buffer::coalesce(&records[0], records.size(), gap);
+            bool failed = count > records.size() || (records.empty() != (count == 0));
+            u::vector<unsigned char> flushed(kSize);
+            for (size_t i = 0; !failed && i < count; i++) {
+                const r::buffer::flushRecord &it = records[i];
+                if (i && it.offset <= records[i - 1].offset + records[i - 1].count + gap)
+                    failed = true;
+                else if (!written[it.offset] || !written[it.offset + it.count - 1])
+                    failed = true;
+                else
+                    memset(&flushed[it.offset], 1, it.count);
+            }
+            for (size_t i = 0; !failed && i < kSize; i++)
+                if (written[i] && !flushed[i])
+                    failed = true;
+            failures += failed;
+            cases++;
         }
-        previousRecord = currentRecord;
     }
-    if (gl::has(gl::ARB_map_buffer_range)) {
-        // Flush the writes to memory with one flush after the other.
-        for (auto &it : m_flushRecords)
-            gl::FlushMappedBufferRange(GL_ARRAY_BUFFER, it.offset, it.count);
-        deleteMapping(m_bufferIndex);
-    } else {
-        // Flush the changes using BufferSubData calls
-        for (auto &it : m_flushRecords) {
-            gl::BufferSubData(GL_ARRAY_BUFFER, it.offset, it.count,
-                (const void *)&m_bufferMappings[m_bufferIndex] + it.offset);
+}
+
+// Random writes through the ring on the mock backend, every written byte has
+// to reach the device copy of the region by the end of the frame and no region
+// may be changed while the simulated GPU is using it.
+static void testRing(size_t &cases, size_t &failures) {
+    const size_t kSize = 1024;
+    for (size_t count = 1; count <= 4; count++) {
+        for (size_t coherent = 0; coherent < 2; coherent++) {
+            r::mockBackend backend(std::chrono::microseconds(50), coherent);
+            r::staging ring(&backend, kSize, count);
+            ring.init();
+            for (size_t frame = 0; frame < 200; frame++) {
+                u::vector<unsigned char> expected(kSize);
+                u::vector<unsigned char> written(kSize);
+                ring.setFlushGap(frame % 3 * 8);
+                ring.beginChanges();
+                for (size_t i = rand() % 32; i; i--) {
+                    unsigned char data[64];
+                    const size_t size = 1 + rand() % sizeof data;
+                    const size_t offset = rand() % (kSize - size);
+                    for (size_t j = 0; j < size; j++)
+                        data[j] = rand();
+                    ring.write(data, size, offset);
+                    memcpy(&expected[offset], data, size);
+                    memset(&written[offset], 1, size);
+                }
+                ring.endChanges();
+                const unsigned char *device = backend.device(ring.offset() / kSize);
+                bool failed = false;
+                for (size_t i = 0; i < kSize; i++)
+                    if (written[i] && device[i] != expected[i])
+                        failed = true;
+                ring.postChanges();
+                failures += failed;
+                cases++;
+            }
+            failures += backend.races() != 0;
+            cases++;
         }
     }
-    m_flushRecords.clear();
 }
 
-void buffer::postChanges() {
-    // Insert a fence into the command queue. The next use of this buffer will
-    // have to wait for the commands to be complete.
-    if (gl::has(gl::ARB_sync))
-        m_bufferFences[m_bufferIndex] = gl::FenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+// Strided writes through the ring have to pack exactly the elements a copy
+// per element would, for elements on either side of the 16 bytes moved at a
+// time, strides smaller than the element and a zero stride.
+static void testStrided(size_t &cases, size_t &failures) {
+    const size_t kSize = 1024;
+    const size_t sizes[] = { 1, 4, 12, 16, 20 };
+    const size_t counts[] = { 1, 2, 3, 8, 33 };
+    for (size_t coherent = 0; coherent < 2; coherent++) {
+        r::mockBackend backend(std::chrono::microseconds(50), coherent);
+        r::staging ring(&backend, kSize, 2);
+        ring.init();
+        for (size_t size : sizes) {
+            const size_t strides[] = { 0, 4, size, size + 4, 32 };
+            for (size_t stride : strides) {
+                for (size_t count : counts) {
+                    u::vector<unsigned char> data(stride * (count - 1) + size);
+                    for (auto &it : data)
+                        it = rand();
+                    const size_t offset = rand() % (kSize - size * count);
+                    ring.beginChanges();
+                    ring.writeStrided(&data[0], size, stride, count, offset);
+                    ring.endChanges();
+                    const unsigned char *device = backend.device(ring.offset() / kSize);
+                    bool failed = false;
+                    for (size_t i = 0; i < count; i++)
+                        if (memcmp(device + offset + size * i, &data[stride * i], size) != 0)
+                            failed = true;
+                    ring.postChanges();
+                    failures += failed;
+                    cases++;
+                }
+            }
+        }
+    }
 }
 
-void buffer::write(const void *const data, size_t size, size_t offset) {
-    // Write the data
-    unsigned char *destHead = m_bufferMappings[m_bufferIndex];
-    const unsigned char *const destTail = destHead + m_bufferSize;
-    assert(destHead + offset + size <= destTail);
-    memcpy(destHead + offset, data, size);
-    m_flushRecords.push_back({ offset, size });
+// Reservations after writes of odd sizes are aligned, don't overlap the writes
+// and what's built in them reaches the device copy at the returned offset.
+static void testReserve(size_t &cases, size_t &failures) {
+    const size_t kSize = 1024;
+    for (size_t coherent = 0; coherent < 2; coherent++) {
+        r::mockBackend backend(std::chrono::microseconds(50), coherent);
+        r::staging ring(&backend, kSize, 2);
+        ring.init();
+        for (size_t alignment = 1; alignment <= 64; alignment *= 2) {
+            for (size_t size = 1; size <= 7; size++) {
+                unsigned char data[7];
+                memset(data, 0xAA, sizeof data);
+                ring.beginChanges();
+                ring.write(data, size, 0);
+                size_t offset = 0;
+                unsigned char *reservation = ring.reserve(12, &offset, alignment);
+                bool failed = !reservation || uintptr_t(reservation) % alignment
+                    || offset < size || offset >= size + alignment;
+                if (reservation)
+                    for (size_t i = 0; i < 12; i++)
+                        reservation[i] = (unsigned char)i;
+                // No room left for a reservation past the end
+                failed |= ring.reserve(kSize, nullptr, alignment) != nullptr;
+                ring.endChanges();
+                const unsigned char *device = backend.device(ring.offset() / kSize);
+                for (size_t i = 0; !failed && i < 12; i++)
+                    failed = device[offset + i] != i;
+                failed |= memcmp(device, data, size) != 0;
+                ring.postChanges();
+                failures += failed;
+                cases++;
+            }
+        }
+    }
+}
+
+// When the CPU runs ahead of the GPU the first `count' frames have a free
+// region and every frame after waits on a fence. Nearly all of those waits
+// block, only a CPU descheduled for longer than a frame finds one signaled.
+static void testStalls(size_t &cases, size_t &failures) {
+    for (size_t count = 1; count <= 4; count++) {
+        const size_t kFrames = 20;
+        r::mockBackend backend(std::chrono::milliseconds(2));
+        r::staging ring(&backend, 64, count);
+        ring.init();
+        for (size_t frame = 0; frame < kFrames; frame++) {
+            ring.beginChanges();
+            ring.endChanges();
+            ring.postChanges();
+        }
+        const r::staging::stats stats = ring.totalStats();
+        failures += stats.unfenced != count || stats.stalls + stats.signaled != kFrames - count
+            || stats.stalls <= stats.signaled || backend.races() != 0;
+        cases++;
+    }
+    // A GPU faster than the CPU never makes it wait
+    r::mockBackend backend(std::chrono::microseconds(500));
+    r::staging ring(&backend, 64, 2);
+    ring.init();
+    for (size_t frame = 0; frame < 20; frame++) {
+        ring.beginChanges();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        ring.endChanges();
+        ring.postChanges();
+    }
+    const r::staging::stats stats = ring.totalStats();
+    failures += stats.stalls != 0 || stats.signaled != 18 || stats.unfenced != 2;
+    cases++;
 }
 
+// The adaptive mode grows the ring until the CPU no longer waits on the GPU
+// for longer than the threshold, or up to the maximum. Here the CPU is always
+// ahead so the ring grows to the maximum.
+static void testAdaptive(size_t &cases, size_t &failures) {
+    r::mockBackend backend(std::chrono::milliseconds(1));
+    r::staging ring(&backend, 64, 1);
+    ring.setAdaptive(std::chrono::microseconds(100), 4);
+    ring.init();
+    for (size_t frame = 0; frame < 20; frame++) {
+        ring.beginChanges();
+        const unsigned char data[16] = { 0 };
+        ring.write(data, sizeof data, 0);
+        ring.write(data, sizeof data, sizeof data);
+        ring.endChanges();
+        ring.postChanges();
+    }
+    const r::staging::stats stats = ring.totalStats();
+    failures += ring.count() != 4 || stats.grown != 3 || backend.races() != 0;
+    failures += stats.frames != 20 || stats.unfenced + stats.signaled + stats.stalls != 20;
+    failures += stats.bytesWritten != 20 * 32 || stats.writes != 40 || stats.flushes != 20;
+    failures += stats.coalescing() != 2.0;
+    cases++;
 }
+
+int main() {
+    size_t cases = 0;
+    size_t failures = 0;
+    testCoalesce(cases, failures);
+    testRing(cases, failures);
+    testStalls(cases, failures);
+    testAdaptive(cases, failures);
+    testStrided(cases, failures);
+    testReserve(cases, failures);
+    printf("%zu cases, %zu failures\n", cases, failures);
+    return failures != 0;
+}
+#endif
+
+#ifdef R_BUFFER_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// Streams particles through the buffer for a second at a time and checks the
+// GPU saw the last frame's data. Runs headless on an EGL surfaceless display
+// (Mesa llvmpipe will do) with a core context, the GPU reads the buffer with a
+// copy into another buffer in place of a draw.
+static bool context() {
+    auto getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (!getPlatformDisplay)
+        return false;
+    EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA,
+        EGL_DEFAULT_DISPLAY, nullptr);
+    if (!eglInitialize(display, nullptr, nullptr) || !eglBindAPI(EGL_OPENGL_API))
+        return false;
+    const EGLint attributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    EGLContext context = eglCreateContext(display, EGL_NO_CONFIG_KHR,
+        EGL_NO_CONTEXT, attributes);
+    if (context == EGL_NO_CONTEXT)
+        return false;
+    return eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context);
+}
+
+// Frames of varying CPU time against a GPU taking a fixed time per frame, the
+// amount of stalls and how long the frames took with more regions in the ring.
+static void benchmarkStalls() {
+    const size_t kFrames = 200;
+    for (size_t count = 0; count <= 4; count++) {
+        // Zero starts with one region in the adaptive mode
+        r::mockBackend backend(std::chrono::microseconds(1000));
+        r::staging ring(&backend, 4096, count ? count : 1);
+        if (!count)
+            ring.setAdaptive(std::chrono::microseconds(200));
+        ring.init();
+        srand(1);
+        const auto start = std::chrono::steady_clock::now();
+        for (size_t frame = 0; frame < kFrames; frame++) {
+            ring.beginChanges();
+            std::this_thread::sleep_for(std::chrono::microseconds(200 + rand() % 1600));
+            ring.endChanges();
+            ring.postChanges();
+        }
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        const r::staging::stats stats = ring.totalStats();
+        printf("%zu regions%s: %3zu stalls, %3zu signaled in %zu frames, %.2f ms/frame, %.2f ms waiting\n",
+            ring.count(), count ? "" : " (adaptive)", stats.stalls, stats.signaled, kFrames,
+            elapsed.count() * 1000.0 / kFrames, stats.waitTime.count() / 1e6);
+    }
+}
+
+// Coalescing the records of 100k particle writes, in order, shuffled and
+// spread out with a gap between each particle.
+static void benchmarkCoalesce() {
+    const size_t kWrites = 100000;
+    const size_t kStride = sizeof(float) * 4;
+    const char *names[] = { "in order", "shuffled", "gap" };
+    for (size_t k = 0; k < 3; k++) {
+        u::vector<r::buffer::flushRecord> writes(kWrites);
+        for (size_t i = 0; i < kWrites; i++)
+            writes[i] = { kStride * i, k == 2 ? sizeof(float) * 3 : kStride };
+        if (k == 1)
+            for (size_t i = kWrites - 1; i > 0; i--)
+                u::swap(writes[i], writes[rand() % (i + 1)]);
+        size_t frames = 0;
+        size_t count = 0;
+        std::chrono::duration<double> elapsed(0);
+        do {
+            u::vector<r::buffer::flushRecord> records(writes);
+            const auto start = std::chrono::steady_clock::now();
+            count = r::buffer::coalesce(&records[0], records.size(), sizeof(float));
+            elapsed += std::chrono::steady_clock::now() - start;
+            frames++;
+        } while (elapsed.count() < 1.0);
+        printf("%zu writes %s: ~%.0f frames/s, %zu flush\n", kWrites, names[k],
+            frames / elapsed.count(), count);
+    }
+}
+
+struct particle {
+    float position[3];
+    float velocity[3];
+    float life;
+};
+
+// Streams the positions of `particles' for a second with `write' filling the
+// buffer, then checks the GPU saw the positions of the last frame.
+template <typename F>
+static bool stream(const char *name, u::vector<particle> &particles, const F &write) {
+    const size_t size = sizeof particles[0].position * particles.size();
+
+    GLuint sink;
+    gl::GenBuffers(1, &sink);
+    gl::BindBuffer(GL_COPY_WRITE_BUFFER, sink);
+    gl::BufferData(GL_COPY_WRITE_BUFFER, size, nullptr, GL_STREAM_COPY);
+
+    size_t frames = 0;
+    std::chrono::duration<double> elapsed(0);
+    {
+        r::buffer b(size);
+        b.init();
+        const auto start = std::chrono::steady_clock::now();
+        do {
+            // Different data every frame so a stale region would show
+            particles[0].position[0] = float(frames);
+            b.beginChanges();
+            write(b, particles);
+            b.endChanges();
+            gl::CopyBufferSubData(GL_ARRAY_BUFFER, GL_COPY_WRITE_BUFFER,
+                b.offset(), 0, size);
+            b.postChanges();
+            frames++;
+            elapsed = std::chrono::steady_clock::now() - start;
+        } while (elapsed.count() < 1.0);
+        gl::Finish();
+    }
+
+    u::vector<float> check(particles.size() * 3);
+    gl::GetBufferSubData(GL_COPY_WRITE_BUFFER, 0, size, &check[0]);
+    gl::DeleteBuffers(1, &sink);
+    bool matched = true;
+    for (size_t i = 0; i < particles.size(); i++)
+        if (memcmp(&check[i * 3], particles[i].position, sizeof particles[i].position))
+            matched = false;
+
+    printf("%7zu particles %-12s: %6zu frames, ~%.0f MB/s %s\n", particles.size(),
+        name, frames, frames * size / elapsed.count() / (1024.0 * 1024.0),
+        matched ? "" : "(MISMATCH)");
+    return matched;
+}
+
+int main() {
+    benchmarkStalls();
+    benchmarkCoalesce();
+    if (!context()) {
+        fprintf(stderr, "failed to create EGL surfaceless context, no streaming\n");
+        return 0;
+    }
+    gl::init();
+    printf("%s, %s\n", (const char *)gl::GetString(GL_RENDERER),
+        gl::has(gl::ARB_buffer_storage) && gl::has(gl::ARB_sync)
+            ? "persistent mapping" : "mapping per frame");
+
+    typedef void (*writer)(r::buffer &, const u::vector<particle> &);
+    const writer writers[] = {
+        // One write per particle, like the example use
+        [](r::buffer &b, const u::vector<particle> &particles) {
+            for (size_t i = 0; i < particles.size(); i++)
+                b.write(particles[i].position, sizeof particles[i].position,
+                    sizeof particles[i].position * i);
+        },
+        [](r::buffer &b, const u::vector<particle> &particles) {
+            b.writeStrided(particles[0].position, sizeof particles[0].position,
+                sizeof particles[0], particles.size(), 0);
+        },
+        [](r::buffer &b, const u::vector<particle> &particles) {
+            float *positions = (float *)b.reserve(sizeof particles[0].position * particles.size());
+            for (const auto &it : particles) {
+                *positions++ = it.position[0];
+                *positions++ = it.position[1];
+                *positions++ = it.position[2];
+            }
+        }
+    };
+    const char *names[] = { "write", "writeStrided", "reserve" };
+
+    for (size_t count = 1000; count <= 100000; count *= 10) {
+        u::vector<particle> particles(count);
+        for (auto &it : particles)
+            for (size_t i = 0; i < 3; i++)
+                it.position[i] = rand() / float(RAND_MAX);
+        for (size_t i = 0; i < 3; i++)
+            if (!stream(names[i], particles, writers[i]))
+                return 1;
+    }
+    return 0;
+}
+#endif
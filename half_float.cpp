@@ -6,6 +6,16 @@
 #include <smmintrin.h>
 #endif
 
+#ifdef __F16C__
+#include <immintrin.h>
+#endif
+
+#include <unistd.h>
+#include <math.h>
+
+#include <atomic>
+#include <thread>
+
 #include "m_half.h"
 #include "m_const.h"
 
@@ -16,8 +26,28 @@ static struct halfData {
     // 1536 bytes
     uint32_t baseTable[512];
     uint8_t shiftTable[512];
+    // 8576 bytes
+    uint32_t mantissaTable[2048];
+    uint32_t exponentTable[64];
+    uint16_t offsetTable[64];
 } gHalf;
 
+// Renormalize a half-float subnormal mantissa into a single-precision float
+// with an implicit leading 1-bit. The mantissa is shifted leftward until the
+// leading 1-bit reaches the implicit position, decrementing the exponent for
+// each shift.
+static uint32_t convertMantissa(uint32_t i) {
+    uint32_t mantissa = i << 13;
+    uint32_t exponent = 0;
+    while (!(mantissa & 0x00800000)) {
+        exponent -= 0x00800000;
+        mantissa <<= 1;
+    }
+    mantissa &= ~0x00800000;
+    exponent += 0x38800000;
+    return mantissa | exponent;
+}
+
 halfData::halfData() {
     for (int i = 0, e = 0; i < 256; ++i) {
         e = i - 127;
@@ -25,12 +55,19 @@ halfData::halfData() {
             // When magnitude of the number is really small (2^-24 or smaller),
             // there is no possible half-float representation for the number, so
             // it must be mapped to zero (or negative zero). Setting the shift
-            // table entries to 24 will shift all mantissa bits, leaving just zero.
-            // Base tables store zero otherwise (0x8000 for negative zero case.)
+            // table entries to 24 or more will shift all mantissa bits, leaving
+            // just zero. Base tables store zero otherwise (0x8000 for negative
+            // zero case.)
+            //
+            // The rounding conversion looks at the bit just below the shift with
+            // the implicit 1-bit present. Numbers in [2^-25, 2^-24) round up to
+            // the smallest subnormal so they shift by exactly 24, which makes the
+            // implicit 1-bit the rounding bit. Everything smaller shifts by 25
+            // so that it never rounds.
             baseTable[i|0x000] = 0x0000;
             baseTable[i|0x100] = 0x8000;
-            shiftTable[i|0x000] = 24;
-            shiftTable[i|0x100] = 24;
+            shiftTable[i|0x000] = e == -25 ? 24 : 25;
+            shiftTable[i|0x100] = e == -25 ? 24 : 25;
         } else if (e < -14) {
             // When the number is small (< 2^-14), the value can only be
             // represented using a subnormal half-float. This is the most
@@ -62,11 +99,12 @@ halfData::halfData() {
             // Infinity, They are too large to be represented as half-floats. In
             // this case the base table is set to 0x&c00 (with sign if negative)
             // and the mantissa is zeroed out, which is accomplished by shifting
-            // out all mantissa bits.
+            // out all mantissa bits. Shifting by 25 also keeps the implicit 1-bit
+            // from being treated as a rounding bit.
             baseTable[i|0x000] = 0x7C00;
             baseTable[i|0x100] = 0xFC00;
-            shiftTable[i|0x000] = 24;
-            shiftTable[i|0x100] = 24;
+            shiftTable[i|0x000] = 25;
+            shiftTable[i|0x100] = 25;
         } else {
             // Remaining float numbers such as Infs and NaNs should stay Infs and
             // NaNs after conversion. The base table entries is exactly the same
@@ -78,6 +116,31 @@ halfData::halfData() {
             shiftTable[i|0x100] = 13;
         }
     }
+
+    // The other direction is a lot simpler. A half-float is decoded with the
+    // sum of two table lookups: the mantissa table indexed by the mantissa
+    // bits (adjusted by the offset table so that subnormals and normals get
+    // their own halves of the table) and the exponent table indexed by the
+    // sign and exponent bits.
+    mantissaTable[0] = 0;
+    for (uint32_t i = 1; i < 1024; i++)
+        mantissaTable[i] = convertMantissa(i);
+    for (uint32_t i = 1024; i < 2048; i++)
+        mantissaTable[i] = 0x38000000 + ((i - 1024) << 13);
+
+    // Exponent 0 (zero and subnormals) is handled entirely by the mantissa
+    // table, exponent 31 maps to Inf and NaN with the mantissa preserved.
+    exponentTable[0] = 0;
+    exponentTable[32] = 0x80000000;
+    for (uint32_t i = 1; i < 31; i++) {
+        exponentTable[i|0x00] = i << 23;
+        exponentTable[i|0x20] = 0x80000000 | (i << 23);
+    }
+    exponentTable[31] = 0x47800000;
+    exponentTable[63] = 0xC7800000;
+
+    for (uint32_t i = 0; i < 64; i++)
+        offsetTable[i] = (i == 0 || i == 32) ? 0 : 1024;
 }
 
 half convertToHalf(float in) {
@@ -87,24 +150,34 @@ half convertToHalf(float in) {
         ((shape.asInt & 0x007FFFFF) >> gHalf.shiftTable[(shape.asInt >> 23) & 0x1FF]);
 }
 
-#ifdef __SSE2__
-union vectorShape {
-    __m128i asVector;
-    alignas(16) uint32_t asInt[4];
-};
+half convertToHalfRNE(float in) {
+    // Same table lookup as the truncating conversion, the bits shifted out are
+    // then used to round to nearest, ties to even. The carry from rounding up
+    // can ripple into the exponent, which correctly rounds the largest values
+    // to Infinity. Infs are left alone while NaNs are made quiet so a payload
+    // held entirely in the low mantissa bits does not turn into Infinity.
+    floatShape shape;
+    shape.asFloat = in;
+    const uint32_t index = (shape.asInt >> 23) & 0x1FF;
+    const uint32_t shift = gHalf.shiftTable[index];
+    const uint32_t mantissa = shape.asInt & 0x007FFFFF;
+    const uint32_t significand = mantissa | 0x00800000;
+    const uint32_t value = gHalf.baseTable[index] + (mantissa >> shift);
+    if ((index & 0xFF) == 0xFF)
+        return value | (mantissa ? 0x0200 : 0);
+    const uint32_t round = (significand >> (shift - 1)) & 1;
+    const uint32_t sticky = (significand & ((1u << (shift - 1)) - 1)) != 0;
+    return value + (round & (sticky | (value & 1)));
+}
 
-template <unsigned int I>
-static inline int extractScalar(__m128i v) {
-#ifdef __SSE4_1__
-    return _mm_extract_epi32(v, I);
-#else
-    // Not pretty
-    vectorShape shape;
-    shape.asVector = v;
-    return shape.asInt[I];
-#endif
+float convertToFloat(half in) {
+    floatShape shape;
+    shape.asInt = gHalf.mantissaTable[gHalf.offsetTable[in >> 10] + (in & 0x3FF)] +
+        gHalf.exponentTable[in >> 10];
+    return shape.asFloat;
 }
 
+#ifdef __SSE2__
 static __m128i convertToHalfSSE2(__m128 f) {
     // ~15 SSE2 ops
     alignas(16) static const uint32_t kMaskAbsolute[4] = { 0x7fffffffu, 0x7fffffffu, 0x7fffffffu, 0x7fffffffu };
@@ -131,31 +204,909 @@ static __m128i convertToHalfSSE2(__m128 f) {
 
     return value;
 }
+
+static __m128 convertToFloatSSE2(__m128i h) {
+    // ~12 SSE2 ops
+    //
+    // Expects the half-floats zero extended to 32-bits in each lane. The
+    // exponent and mantissa are shifted into place and then rebiased with
+    // a multiply, which also takes care of subnormals for free since the
+    // shifted subnormal half is a subnormal float that the multiply will
+    // normalize. Inf and NaN need their exponent forced to all ones after.
+    alignas(16) static const uint32_t kMaskNoSign[4] = { 0x7fff, 0x7fff, 0x7fff, 0x7fff };
+    alignas(16) static const uint32_t kMagic[4] = { (254 - 15) << 23, (254 - 15) << 23, (254 - 15) << 23, (254 - 15) << 23 };
+    alignas(16) static const uint32_t kWasInfNan[4] = { 0x7bff, 0x7bff, 0x7bff, 0x7bff };
+    alignas(16) static const uint32_t kExpInfNan[4] = { 255 << 23, 255 << 23, 255 << 23, 255 << 23 };
+
+    const __m128i maskNoSign   = *(const __m128i *)&kMaskNoSign;
+    const __m128i expMantissa  = _mm_and_si128(maskNoSign, h);
+    const __m128i justSign     = _mm_xor_si128(h, expMantissa);
+    const __m128i shifted      = _mm_slli_epi32(expMantissa, 13);
+    const __m128  scaled       = _mm_mul_ps(_mm_castsi128_ps(shifted), *(const __m128 *)&kMagic);
+    const __m128i wasInfNan    = _mm_cmpgt_epi32(expMantissa, *(const __m128i *)&kWasInfNan);
+    const __m128i signShifted  = _mm_slli_epi32(justSign, 16);
+    const __m128i infNanExp    = _mm_and_si128(wasInfNan, *(const __m128i *)&kExpInfNan);
+    const __m128i signInfNan   = _mm_or_si128(signShifted, infNanExp);
+    const __m128  value        = _mm_or_ps(scaled, _mm_castsi128_ps(signInfNan));
+
+    return value;
+}
+#endif
+
+#ifdef __SSE2__
+static __m128i convertToHalfRNESSE2(__m128 f) {
+    // ~25 SSE2 ops
+    //
+    // Subnormal results are rounded by the FPU: adding a magic value aligns
+    // the 10 mantissa bits at the bottom of the float, and since the addition
+    // rounds to nearest even the result is correctly rounded. Normal results
+    // are rounded with integer math, by adding 0xFFF (just under half an ULP)
+    // plus the ULP's low bit, which breaks ties towards even.
+    alignas(16) static const uint32_t kMaskSign[4] = { 0x80000000u, 0x80000000u, 0x80000000u, 0x80000000u };
+    alignas(16) static const uint32_t kMax[4] = { (127 + 16) << 23, (127 + 16) << 23, (127 + 16) << 23, (127 + 16) << 23 };
+    alignas(16) static const uint32_t kMinNormal[4] = { (127 - 14) << 23, (127 - 14) << 23, (127 - 14) << 23, (127 - 14) << 23 };
+    alignas(16) static const uint32_t kSubnormalMagic[4] = { ((127 - 15) + (23 - 10) + 1) << 23, ((127 - 15) + (23 - 10) + 1) << 23, ((127 - 15) + (23 - 10) + 1) << 23, ((127 - 15) + (23 - 10) + 1) << 23 };
+    alignas(16) static const uint32_t kNormalBias[4] = { 0xfffu - ((127u - 15u) << 23), 0xfffu - ((127u - 15u) << 23), 0xfffu - ((127u - 15u) << 23), 0xfffu - ((127u - 15u) << 23) };
+    alignas(16) static const uint32_t kInf16[4] = { 0x7c00, 0x7c00, 0x7c00, 0x7c00 };
+    alignas(16) static const uint32_t kNanBit[4] = { 0x0200, 0x0200, 0x0200, 0x0200 };
+    alignas(16) static const uint32_t kMantissa16[4] = { 0x03ff, 0x03ff, 0x03ff, 0x03ff };
+
+    const __m128  justSign     = _mm_and_ps(*(const __m128 *)&kMaskSign, f);
+    const __m128  absolute     = _mm_xor_ps(f, justSign);
+    const __m128i absoluteInt  = _mm_castps_si128(absolute);
+    const __m128i isNan        = _mm_castps_si128(_mm_cmpunord_ps(absolute, absolute));
+    const __m128i isRegular    = _mm_cmpgt_epi32(*(const __m128i *)&kMax, absoluteInt);
+    const __m128i isSubnormal  = _mm_cmpgt_epi32(*(const __m128i *)&kMinNormal, absoluteInt);
+    // Inf or quiet NaN keeping the top of the payload
+    const __m128i payload      = _mm_and_si128(_mm_srli_epi32(absoluteInt, 13), *(const __m128i *)&kMantissa16);
+    const __m128i nanBits      = _mm_and_si128(isNan, _mm_or_si128(payload, *(const __m128i *)&kNanBit));
+    const __m128i infNan       = _mm_or_si128(nanBits, *(const __m128i *)&kInf16);
+    // Subnormal results
+    const __m128  subnormal1   = _mm_add_ps(absolute, *(const __m128 *)&kSubnormalMagic);
+    const __m128i subnormal2   = _mm_sub_epi32(_mm_castps_si128(subnormal1), *(const __m128i *)&kSubnormalMagic);
+    // Normal results
+    const __m128i mantissaOdd  = _mm_srai_epi32(_mm_slli_epi32(absoluteInt, 31 - 13), 31);
+    const __m128i round1       = _mm_add_epi32(absoluteInt, *(const __m128i *)&kNormalBias);
+    const __m128i round2       = _mm_sub_epi32(round1, mantissaOdd);
+    const __m128i normal       = _mm_srli_epi32(round2, 13);
+    // Merge everything
+    const __m128i merge1       = _mm_or_si128(_mm_and_si128(isSubnormal, subnormal2), _mm_andnot_si128(isSubnormal, normal));
+    const __m128i merge2       = _mm_or_si128(_mm_and_si128(isRegular, merge1), _mm_andnot_si128(isRegular, infNan));
+    const __m128i signShifted  = _mm_srli_epi32(_mm_castps_si128(justSign), 16);
+    const __m128i value        = _mm_or_si128(merge2, signShifted);
+
+    return value;
+}
+
+// Convert eight floats into eight packed half-floats
+template <bool RNE>
+static inline __m128i convertToHalf8(const float *in) {
+    const __m128 lo = _mm_loadu_ps(in);
+    const __m128 hi = _mm_loadu_ps(in + 4);
+#ifdef __F16C__
+    // Hardware conversion rounds correctly and quiets NaNs the same way the
+    // table and SSE2 paths do.
+    if (RNE)
+        return _mm_unpacklo_epi64(_mm_cvtps_ph(lo, _MM_FROUND_TO_NEAREST_INT),
+                                  _mm_cvtps_ph(hi, _MM_FROUND_TO_NEAREST_INT));
+#endif
+    const __m128i a = RNE ? convertToHalfRNESSE2(lo) : convertToHalfSSE2(lo);
+    const __m128i b = RNE ? convertToHalfRNESSE2(hi) : convertToHalfSSE2(hi);
+    // Sign extend so the signed saturating pack leaves the bits alone
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                           _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+#endif
+
+template <bool RNE, bool Stream>
+static void convertToHalf(const float *in, half *out, size_t length) {
+    size_t where = 0;
+#ifdef __SSE2__
+    if (Stream) {
+        // Non-temporal stores need a 16 byte aligned destination
+        for (; where < length && ((uintptr_t)&out[where] & 15); where++)
+            out[where] = RNE ? convertToHalfRNE(in[where]) : convertToHalf(in[where]);
+        for (; where + 8 <= length; where += 8)
+            _mm_stream_si128((__m128i *)&out[where], convertToHalf8<RNE>(&in[where]));
+        _mm_sfence();
+    } else {
+        for (; where + 8 <= length; where += 8)
+            _mm_storeu_si128((__m128i *)&out[where], convertToHalf8<RNE>(&in[where]));
+    }
+#endif
+    for (; where < length; where++)
+        out[where] = RNE ? convertToHalfRNE(in[where]) : convertToHalf(in[where]);
+}
+
+// Number of floats converted by a thread at a time. The 128KiB of input and
+// 64KiB of output stay in L2 while a chunk is being converted.
+static constexpr size_t kChunkSize = 32u << 10;
+
+static size_t cacheSize() {
+#ifdef _SC_LEVEL3_CACHE_SIZE
+    const long size = sysconf(_SC_LEVEL3_CACHE_SIZE);
+    if (size > 0)
+        return size_t(size);
 #endif
+    return 8u << 20;
+}
+
+// When the output cannot fit in the last level cache anyways, writing it
+// through the cache only evicts the input that is about to be read. Use
+// non-temporal stores for those instead.
+static bool streamStores(size_t length) {
+    static const size_t kCacheSize = cacheSize();
+    return length * sizeof(half) > kCacheSize;
+}
+
+template <bool RNE>
+static void convertToHalf(const float *in, half *out, size_t length, size_t threads, bool stream) {
+    // Threads take chunks from a shared counter instead of splitting the
+    // input evenly up front so a thread that gets descheduled doesn't hold
+    // up the rest.
+    const size_t chunks = (length + kChunkSize - 1) / kChunkSize;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > chunks)
+        threads = chunks;
+    if (threads == 0)
+        threads = 1;
+
+    std::atomic<size_t> next(0);
+    const auto work = [&]() {
+        for (size_t chunk; (chunk = next++) < chunks; ) {
+            const size_t begin = chunk * kChunkSize;
+            const size_t count = length - begin < kChunkSize ? length - begin : kChunkSize;
+            if (stream)
+                convertToHalf<RNE, true>(in + begin, out + begin, count);
+            else
+                convertToHalf<RNE, false>(in + begin, out + begin, count);
+        }
+    };
+
+    // The calling thread does its share of the work too
+    u::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++)
+        pool.push_back(std::thread(work));
+    work();
+    for (auto &it : pool)
+        it.join();
+}
 
 u::vector<half> convertToHalf(const float *in, size_t length) {
     u::vector<half> result(length);
-#ifdef __SSE2__
-    const int blocks = int(length) / 4;
-    const int remainder = int(length) % 4;
-    int where = 0;
-    for (int i = 0; i < blocks; i++) {
-        const __m128 value = _mm_load_ps(&in[where]);
-        const __m128i convert = convertToHalfSSE2(value);
-        result[where++] = extractScalar<0>(convert);
-        result[where++] = extractScalar<1>(convert);
-        result[where++] = extractScalar<2>(convert);
-        result[where++] = extractScalar<3>(convert);
-    }
-    for (int i = 0; i < remainder; i++) {
-        result[where+i] = convertToHalf(in[where+i]);
-        where++;
+    convertToHalf<false, false>(in, &result[0], length);
+    return result;
+}
+
+u::vector<half> convertToHalfRNE(const float *in, size_t length) {
+    u::vector<half> result(length);
+    convertToHalf<true, false>(in, &result[0], length);
+    return result;
+}
+
+// Parallel variants for large buffers, `threads' of zero uses all hardware threads
+u::vector<half> convertToHalf(const float *in, size_t length, size_t threads) {
+    u::vector<half> result(length);
+    convertToHalf<false>(in, &result[0], length, threads, streamStores(length));
+    return result;
+}
+
+u::vector<half> convertToHalfRNE(const float *in, size_t length, size_t threads) {
+    u::vector<half> result(length);
+    convertToHalf<true>(in, &result[0], length, threads, streamStores(length));
+    return result;
+}
+
+u::vector<float> convertToFloat(const half *in, size_t length) {
+    u::vector<float> result(length);
+#if defined(__F16C__) || defined(__SSE2__)
+    const size_t blocks = length / 4;
+    const size_t remainder = length % 4;
+    size_t where = 0;
+    for (size_t i = 0; i < blocks; i++) {
+        const __m128i value = _mm_loadl_epi64((const __m128i *)&in[where]);
+#ifdef __F16C__
+        // Hardware conversion is exact, no need for any tricks. The only
+        // difference from the other paths is signaling NaNs come back quiet.
+        const __m128 convert = _mm_cvtph_ps(value);
+#else
+        const __m128 convert = convertToFloatSSE2(_mm_unpacklo_epi16(value, _mm_setzero_si128()));
+#endif
+        _mm_storeu_ps(&result[where], convert);
+        where += 4;
     }
+    for (size_t i = 0; i < remainder; i++)
+        result[where+i] = convertToFloat(in[where+i]);
 #else
     for (size_t i = 0; i < length; i++)
-        result[i] = convertToHalf(in[i]);
+        result[i] = convertToFloat(in[i]);
 #endif
     return result;
 }
 
+
+// Normalized integer formats. Floats are clamped to the representable range
+// (NaN becomes zero) and rounded to nearest even, which is what cvtps2dq does
+// under the default rounding mode, so the scalar and SIMD paths agree exactly.
+// Decoding divides rather than multiplying by the reciprocal so that every
+// code maps to the correctly rounded float.
+static inline float clampUnit(float in, float min) {
+    if (in != in)
+        return 0.0f;
+    return in > 1.0f ? 1.0f : (in > min ? in : min);
+}
+
+uint8_t convertToUnorm8(float in) {
+    return uint8_t(lrintf(clampUnit(in, 0.0f) * 255.0f));
+}
+
+int8_t convertToSnorm8(float in) {
+    return int8_t(lrintf(clampUnit(in, -1.0f) * 127.0f));
 }
+
+uint16_t convertToUnorm16(float in) {
+    return uint16_t(lrintf(clampUnit(in, 0.0f) * 65535.0f));
+}
+
+float convertFromUnorm8(uint8_t in) {
+    return float(in) / 255.0f;
+}
+
+float convertFromSnorm8(int8_t in) {
+    // Both -128 and -127 map to -1
+    const float value = float(in) / 127.0f;
+    return value < -1.0f ? -1.0f : value;
+}
+
+float convertFromUnorm16(uint16_t in) {
+    return float(in) / 65535.0f;
+}
+
+// bfloat16 is the top half of a float. Rounding to nearest even is done by
+// adding just under half an ULP plus the ULP's low bit before truncating.
+// NaNs are made quiet so a payload in the low bits does not turn into Inf.
+uint16_t convertToBFloat16(float in) {
+    floatShape shape;
+    shape.asFloat = in;
+    if ((shape.asInt & 0x7FFFFFFF) > 0x7F800000)
+        return (shape.asInt >> 16) | 0x0040;
+    return (shape.asInt + 0x7FFF + ((shape.asInt >> 16) & 1)) >> 16;
+}
+
+float convertFromBFloat16(uint16_t in) {
+    floatShape shape;
+    shape.asInt = uint32_t(in) << 16;
+    return shape.asFloat;
+}
+
+// Unsigned small floats with a 5-bit exponent (bias 15) and `M' mantissa bits
+// as used by R11G11B10F (6 and 5 mantissa bits.) There is no sign bit, so
+// negative values become zero. Rounding is to nearest even with overflow to
+// Infinity, like the half-float conversion.
+template <unsigned int M>
+static inline uint32_t convertToSmallFloat(float in) {
+    floatShape shape;
+    shape.asFloat = in;
+    const uint32_t bits = shape.asInt;
+    if ((bits & 0x7FFFFFFF) > 0x7F800000)
+        return (0x1F << M) | (1 << (M - 1)); // Quiet NaN
+    if (bits & 0x80000000)
+        return 0;
+    const int exponent = int(bits >> 23) - 127;
+    if (exponent > 15)
+        return 0x1F << M;
+    const uint32_t significand = (bits & 0x007FFFFF) | 0x00800000;
+    uint32_t shift;
+    uint32_t value;
+    if (exponent < -14) {
+        // Subnormal, the implicit 1-bit becomes part of the mantissa. Anything
+        // under half the smallest subnormal rounds to zero.
+        shift = (23 - M) + uint32_t(-14 - exponent);
+        if (shift > 24)
+            return 0;
+        value = significand >> shift;
+    } else {
+        shift = 23 - M;
+        value = (uint32_t(exponent + 15) << M) | ((significand & 0x007FFFFF) >> shift);
+    }
+    const uint32_t round = (significand >> (shift - 1)) & 1;
+    const uint32_t sticky = (significand & ((1u << (shift - 1)) - 1)) != 0;
+    // A carry out of the mantissa correctly increments the exponent, even to Inf
+    return value + (round & (sticky | (value & 1)));
+}
+
+template <unsigned int M>
+static inline float convertFromSmallFloat(uint32_t in) {
+    const uint32_t exponent = (in >> M) & 0x1F;
+    const uint32_t mantissa = in & ((1u << M) - 1);
+    floatShape shape;
+    if (exponent == 0x1F) {
+        shape.asInt = 0x7F800000 | (mantissa << (23 - M));
+    } else if (exponent == 0) {
+        // Subnormal, exact since the mantissa has at most 6 bits
+        shape.asFloat = float(mantissa) * (1.0f / float(1 << M)) * (1.0f / 16384.0f);
+    } else {
+        shape.asInt = ((exponent - 15 + 127) << 23) | (mantissa << (23 - M));
+    }
+    return shape.asFloat;
+}
+
+uint32_t convertToR11G11B10F(const float *rgb) {
+    return convertToSmallFloat<6>(rgb[0])
+         | convertToSmallFloat<6>(rgb[1]) << 11
+         | convertToSmallFloat<5>(rgb[2]) << 22;
+}
+
+void convertFromR11G11B10F(uint32_t in, float *rgb) {
+    rgb[0] = convertFromSmallFloat<6>(in & 0x7FF);
+    rgb[1] = convertFromSmallFloat<6>((in >> 11) & 0x7FF);
+    rgb[2] = convertFromSmallFloat<5>(in >> 22);
+}
+
+// Shared exponent RGB9E5 following the EXT_texture_shared_exponent encoding:
+// the exponent is chosen for the largest channel and each channel gets a 9-bit
+// mantissa (without an implicit 1-bit) scaled by it.
+static inline float exponentScale(int exponent) {
+    // 2^exponent for exponents in normal float range
+    floatShape shape;
+    shape.asInt = uint32_t(exponent + 127) << 23;
+    return shape.asFloat;
+}
+
+uint32_t convertToRGB9E5(const float *rgb) {
+    static constexpr float kMax = 65408.0f; // (2^9-1)/2^9 * 2^16
+    float channel[3];
+    for (size_t i = 0; i < 3; i++)
+        channel[i] = rgb[i] > 0.0f ? (rgb[i] < kMax ? rgb[i] : kMax) : 0.0f; // NaN fails both
+    const float max = channel[0] > channel[1]
+        ? (channel[0] > channel[2] ? channel[0] : channel[2])
+        : (channel[1] > channel[2] ? channel[1] : channel[2]);
+    // floor(log2(max)) straight from the float exponent. Anything smaller than
+    // 2^-16 (including zero and subnormals) shares the smallest exponent.
+    floatShape shape;
+    shape.asFloat = max;
+    int floorLog2 = int(shape.asInt >> 23) - 127;
+    if (floorLog2 < -16)
+        floorLog2 = -16;
+    int exponent = floorLog2 + 1 + 15;
+    // The largest channel can round up to 512, which needs the next exponent
+    // floor(x + 0.5) is done in double since the add can round in float
+    if (uint32_t(double(max) * exponentScale(24 - exponent) + 0.5) == 512)
+        exponent++;
+    const double scale = exponentScale(24 - exponent);
+    uint32_t value = uint32_t(exponent) << 27;
+    for (size_t i = 0; i < 3; i++)
+        value |= uint32_t(double(channel[i]) * scale + 0.5) << (9 * i);
+    return value;
+}
+
+void convertFromRGB9E5(uint32_t in, float *rgb) {
+    const float scale = exponentScale(int(in >> 27) - 24);
+    for (size_t i = 0; i < 3; i++)
+        rgb[i] = float((in >> (9 * i)) & 0x1FF) * scale;
+}
+
+#ifdef __SSE2__
+static inline __m128 clampUnitSSE2(__m128 in, __m128 min) {
+    const __m128 ordered = _mm_and_ps(_mm_cmpord_ps(in, in), in); // NaN to zero
+    return _mm_min_ps(_mm_max_ps(ordered, min), _mm_set1_ps(1.0f));
+}
+
+// Convert four floats into 32-bit lanes of rounded, scaled integers
+static inline __m128i convertToNormSSE2(const float *in, __m128 min, __m128 scale) {
+    return _mm_cvtps_epi32(_mm_mul_ps(clampUnitSSE2(_mm_loadu_ps(in), min), scale));
+}
+
+static inline __m128i convertToBFloat16SSE2(const float *in) {
+    alignas(16) static const uint32_t kBias[4] = { 0x7fff, 0x7fff, 0x7fff, 0x7fff };
+    alignas(16) static const uint32_t kOne[4] = { 1, 1, 1, 1 };
+    alignas(16) static const uint32_t kQuiet[4] = { 0x40, 0x40, 0x40, 0x40 };
+
+    const __m128  value    = _mm_loadu_ps(in);
+    const __m128i bits     = _mm_castps_si128(value);
+    const __m128i isNan    = _mm_castps_si128(_mm_cmpunord_ps(value, value));
+    const __m128i top      = _mm_srli_epi32(bits, 16);
+    const __m128i odd      = _mm_and_si128(top, *(const __m128i *)&kOne);
+    const __m128i rounded  = _mm_srli_epi32(_mm_add_epi32(_mm_add_epi32(bits, *(const __m128i *)&kBias), odd), 16);
+    const __m128i quiet    = _mm_or_si128(top, *(const __m128i *)&kQuiet);
+    return _mm_or_si128(_mm_and_si128(isNan, quiet), _mm_andnot_si128(isNan, rounded));
+}
+
+// Pack the low 16-bits of each 32-bit lane of two vectors
+static inline __m128i packLow16SSE2(__m128i a, __m128i b) {
+    // Sign extend so the signed saturating pack leaves the bits alone
+    return _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                           _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+}
+#endif
+
+u::vector<uint8_t> convertToUnorm8(const float *in, size_t length) {
+    u::vector<uint8_t> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128 min = _mm_setzero_ps();
+    const __m128 scale = _mm_set1_ps(255.0f);
+    for (; where + 16 <= length; where += 16) {
+        const __m128i a = convertToNormSSE2(&in[where+0], min, scale);
+        const __m128i b = convertToNormSSE2(&in[where+4], min, scale);
+        const __m128i c = convertToNormSSE2(&in[where+8], min, scale);
+        const __m128i d = convertToNormSSE2(&in[where+12], min, scale);
+        const __m128i packed = _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i *)&result[where], packed);
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertToUnorm8(in[where]);
+    return result;
+}
+
+u::vector<int8_t> convertToSnorm8(const float *in, size_t length) {
+    u::vector<int8_t> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128 min = _mm_set1_ps(-1.0f);
+    const __m128 scale = _mm_set1_ps(127.0f);
+    for (; where + 16 <= length; where += 16) {
+        const __m128i a = convertToNormSSE2(&in[where+0], min, scale);
+        const __m128i b = convertToNormSSE2(&in[where+4], min, scale);
+        const __m128i c = convertToNormSSE2(&in[where+8], min, scale);
+        const __m128i d = convertToNormSSE2(&in[where+12], min, scale);
+        const __m128i packed = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+        _mm_storeu_si128((__m128i *)&result[where], packed);
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertToSnorm8(in[where]);
+    return result;
+}
+
+u::vector<uint16_t> convertToUnorm16(const float *in, size_t length) {
+    u::vector<uint16_t> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128 min = _mm_setzero_ps();
+    const __m128 scale = _mm_set1_ps(65535.0f);
+    for (; where + 8 <= length; where += 8) {
+        const __m128i a = convertToNormSSE2(&in[where+0], min, scale);
+        const __m128i b = convertToNormSSE2(&in[where+4], min, scale);
+        _mm_storeu_si128((__m128i *)&result[where], packLow16SSE2(a, b));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertToUnorm16(in[where]);
+    return result;
+}
+
+u::vector<uint16_t> convertToBFloat16(const float *in, size_t length) {
+    u::vector<uint16_t> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    for (; where + 8 <= length; where += 8) {
+        const __m128i a = convertToBFloat16SSE2(&in[where+0]);
+        const __m128i b = convertToBFloat16SSE2(&in[where+4]);
+        _mm_storeu_si128((__m128i *)&result[where], packLow16SSE2(a, b));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertToBFloat16(in[where]);
+    return result;
+}
+
+u::vector<float> convertFromUnorm8(const uint8_t *in, size_t length) {
+    u::vector<float> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(255.0f);
+    for (; where + 8 <= length; where += 8) {
+        const __m128i value = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)&in[where]), zero);
+        const __m128i lo = _mm_unpacklo_epi16(value, zero);
+        const __m128i hi = _mm_unpackhi_epi16(value, zero);
+        _mm_storeu_ps(&result[where+0], _mm_div_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(&result[where+4], _mm_div_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertFromUnorm8(in[where]);
+    return result;
+}
+
+u::vector<float> convertFromSnorm8(const int8_t *in, size_t length) {
+    u::vector<float> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128 min = _mm_set1_ps(-1.0f);
+    const __m128 scale = _mm_set1_ps(127.0f);
+    for (; where + 8 <= length; where += 8) {
+        // Sign extend by unpacking into the high byte and shifting back down
+        const __m128i bytes = _mm_loadl_epi64((const __m128i *)&in[where]);
+        const __m128i value = _mm_unpacklo_epi8(bytes, bytes);
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(value, value), 24);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(value, value), 24);
+        _mm_storeu_ps(&result[where+0], _mm_max_ps(_mm_div_ps(_mm_cvtepi32_ps(lo), scale), min));
+        _mm_storeu_ps(&result[where+4], _mm_max_ps(_mm_div_ps(_mm_cvtepi32_ps(hi), scale), min));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertFromSnorm8(in[where]);
+    return result;
+}
+
+u::vector<float> convertFromUnorm16(const uint16_t *in, size_t length) {
+    u::vector<float> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128 scale = _mm_set1_ps(65535.0f);
+    for (; where + 8 <= length; where += 8) {
+        const __m128i value = _mm_loadu_si128((const __m128i *)&in[where]);
+        const __m128i lo = _mm_unpacklo_epi16(value, zero);
+        const __m128i hi = _mm_unpackhi_epi16(value, zero);
+        _mm_storeu_ps(&result[where+0], _mm_div_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(&result[where+4], _mm_div_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertFromUnorm16(in[where]);
+    return result;
+}
+
+u::vector<float> convertFromBFloat16(const uint16_t *in, size_t length) {
+    u::vector<float> result(length);
+    size_t where = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    for (; where + 8 <= length; where += 8) {
+        // Interleaving with zero in the low half is the shift by 16
+        const __m128i value = _mm_loadu_si128((const __m128i *)&in[where]);
+        _mm_storeu_si128((__m128i *)&result[where+0], _mm_unpacklo_epi16(zero, value));
+        _mm_storeu_si128((__m128i *)&result[where+4], _mm_unpackhi_epi16(zero, value));
+    }
+#endif
+    for (; where < length; where++)
+        result[where] = convertFromBFloat16(in[where]);
+    return result;
+}
+
+// The shared exponent formats depend on all three channels of a pixel and pack
+// them into a single word, so they don't map onto 4-wide SIMD lanes the way
+// the per-value formats do. They use the scalar path for every pixel.
+u::vector<uint32_t> convertToR11G11B10F(const float *rgb, size_t pixels) {
+    u::vector<uint32_t> result(pixels);
+    for (size_t i = 0; i < pixels; i++)
+        result[i] = convertToR11G11B10F(&rgb[i*3]);
+    return result;
+}
+
+u::vector<uint32_t> convertToRGB9E5(const float *rgb, size_t pixels) {
+    u::vector<uint32_t> result(pixels);
+    for (size_t i = 0; i < pixels; i++)
+        result[i] = convertToRGB9E5(&rgb[i*3]);
+    return result;
+}
+
+u::vector<float> convertFromR11G11B10F(const uint32_t *in, size_t pixels) {
+    u::vector<float> result(pixels * 3);
+    for (size_t i = 0; i < pixels; i++)
+        convertFromR11G11B10F(in[i], &result[i*3]);
+    return result;
+}
+
+u::vector<float> convertFromRGB9E5(const uint32_t *in, size_t pixels) {
+    u::vector<float> result(pixels * 3);
+    for (size_t i = 0; i < pixels; i++)
+        convertFromRGB9E5(in[i], &result[i*3]);
+    return result;
+}
+
+}
+
+#ifdef HALF_FLOAT_TEST
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+static uint32_t floatBits(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    return bits;
+}
+
+static float bitsFloat(uint32_t bits) {
+    float value;
+    memcpy(&value, &bits, sizeof value);
+    return value;
+}
+
+// Decodes the half with double precision math instead of tables or bit tricks
+static uint32_t referenceToFloat(m::half in) {
+    const uint32_t sign = in >> 15;
+    const uint32_t exponent = (in >> 10) & 0x1F;
+    const uint32_t mantissa = in & 0x3FF;
+    if (exponent == 0x1F)
+        return (sign << 31) | 0x7F800000 | (mantissa << 13);
+    const double value = exponent == 0
+        ? ldexp(double(mantissa), -24)
+        : ldexp(double(mantissa | 0x400), int(exponent) - 25);
+    return floatBits(float(sign ? -value : value));
+}
+
+// Every half through the table, SSE2 and F16C paths. F16C is allowed to return
+// signaling NaNs quiet.
+static void testToFloat(size_t &cases, size_t &failures) {
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        const m::half in = m::half(i);
+        const uint32_t expected = referenceToFloat(in);
+        failures += floatBits(m::convertToFloat(in)) != expected;
+        cases++;
+#ifdef __SSE2__
+        const __m128i value = _mm_set1_epi32(int(in));
+        failures += floatBits(_mm_cvtss_f32(m::convertToFloatSSE2(value))) != expected;
+        cases++;
+#endif
+#ifdef __F16C__
+        const uint32_t hardware = floatBits(_mm_cvtss_f32(_mm_cvtph_ps(value)));
+        const bool signaling = (in & 0x7C00) == 0x7C00 && (in & 0x3FF) && !(in & 0x200);
+        failures += hardware != expected && !(signaling && hardware == (expected | 0x00400000));
+        cases++;
+#endif
+    }
+}
+
+// Rounds to nearest even with double precision math: the value is divided by
+// the ULP of its binade, rounded with nearbyint and encoded again. NaNs keep
+// the top of their payload and are made quiet.
+static m::half referenceToHalfRNE(uint32_t bits) {
+    const m::half sign = (bits >> 16) & 0x8000;
+    const uint32_t absolute = bits & 0x7FFFFFFF;
+    if (absolute > 0x7F800000)
+        return sign | 0x7C00 | 0x0200 | ((absolute >> 13) & 0x3FF);
+    const double value = bitsFloat(absolute);
+    if (value >= 65520.0)
+        return sign | 0x7C00;
+    if (value < ldexp(1.0, -14)) {
+        // Subnormal, rounding up to 1024 ULPs is the smallest normal
+        return sign | m::half(nearbyint(value / ldexp(1.0, -24)));
+    }
+    const int exponent = ilogb(value);
+    const uint32_t mantissa = uint32_t(nearbyint(value / ldexp(1.0, exponent - 10)));
+    // Rounding up to 2048 ULPs carries into the exponent
+    return sign | m::half(((exponent + 15) << 10) + (mantissa - 1024));
+}
+
+// Every float through the scalar, SSE2 and F16C rounding conversions. The
+// inputs are split evenly across the threads, the calling thread checks the
+// first share.
+static void testToHalfRNE(size_t &cases, size_t &failures) {
+    static constexpr uint64_t kInputs = uint64_t(1) << 32;
+    const size_t threads = std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1;
+    const uint64_t share = (kInputs / threads) & ~uint64_t(3);
+    std::atomic<size_t> checked(0);
+    std::atomic<size_t> failed(0);
+    const auto work = [&](uint64_t begin, uint64_t end) {
+        size_t localChecked = 0;
+        size_t localFailed = 0;
+        for (uint64_t i = begin; i < end; i += 4) {
+            float in[4];
+            m::half expected[4];
+            for (size_t j = 0; j < 4; j++) {
+                in[j] = bitsFloat(uint32_t(i + j));
+                expected[j] = referenceToHalfRNE(uint32_t(i + j));
+                localFailed += m::convertToHalfRNE(in[j]) != expected[j];
+            }
+            localChecked += 4;
+#ifdef __SSE2__
+            alignas(16) uint32_t simd[4];
+            _mm_store_si128((__m128i *)simd, m::convertToHalfRNESSE2(_mm_loadu_ps(in)));
+            for (size_t j = 0; j < 4; j++)
+                localFailed += simd[j] != expected[j];
+            localChecked += 4;
+#endif
+#ifdef __F16C__
+            alignas(16) m::half hardware[8];
+            _mm_store_si128((__m128i *)hardware, _mm_cvtps_ph(_mm_loadu_ps(in), _MM_FROUND_TO_NEAREST_INT));
+            for (size_t j = 0; j < 4; j++)
+                localFailed += hardware[j] != expected[j];
+            localChecked += 4;
+#endif
+        }
+        checked += localChecked;
+        failed += localFailed;
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++)
+        pool.emplace_back(work, share * i, i + 1 == threads ? kInputs : share * (i + 1));
+    work(0, threads == 1 ? kInputs : share);
+    for (auto &it : pool)
+        it.join();
+    cases += checked;
+    failures += failed;
+}
+
+// Every 8-bit and 16-bit code decodes to the correctly rounded quotient in the
+// scalar and batch paths and encodes back to the same code. bfloat16 codes
+// decode to the top half of the float and come back the same, except NaNs
+// which come back quiet.
+static void testCodes(size_t &cases, size_t &failures) {
+    u::vector<uint8_t> unorm8(256);
+    u::vector<int8_t> snorm8(256);
+    for (size_t i = 0; i < 256; i++) {
+        unorm8[i] = uint8_t(i);
+        snorm8[i] = int8_t(i - 128);
+    }
+    const u::vector<float> fromUnorm8 = m::convertFromUnorm8(&unorm8[0], unorm8.size());
+    const u::vector<float> fromSnorm8 = m::convertFromSnorm8(&snorm8[0], snorm8.size());
+    for (size_t i = 0; i < 256; i++) {
+        const float unorm = float(unorm8[i] / 255.0);
+        const float snorm = snorm8[i] == -128 ? -1.0f : float(snorm8[i] / 127.0);
+        failures += fromUnorm8[i] != unorm || m::convertFromUnorm8(unorm8[i]) != unorm;
+        failures += m::convertToUnorm8(unorm) != unorm8[i];
+        failures += fromSnorm8[i] != snorm || m::convertFromSnorm8(snorm8[i]) != snorm;
+        // -128 and -127 both decode to -1 which encodes to -127
+        failures += m::convertToSnorm8(snorm) != (snorm8[i] == -128 ? -127 : snorm8[i]);
+        cases += 4;
+    }
+
+    u::vector<uint16_t> codes(0x10000);
+    for (size_t i = 0; i < codes.size(); i++)
+        codes[i] = uint16_t(i);
+    const u::vector<float> fromUnorm16 = m::convertFromUnorm16(&codes[0], codes.size());
+    const u::vector<float> fromBFloat16 = m::convertFromBFloat16(&codes[0], codes.size());
+    for (uint32_t i = 0; i < 0x10000; i++) {
+        const float unorm = float(i / 65535.0);
+        failures += fromUnorm16[i] != unorm || m::convertFromUnorm16(uint16_t(i)) != unorm;
+        failures += m::convertToUnorm16(unorm) != i;
+        const bool nan = (i & 0x7F80) == 0x7F80 && (i & 0x7F);
+        const uint16_t bfloat16 = m::convertToBFloat16(fromBFloat16[i]);
+        failures += floatBits(fromBFloat16[i]) != i << 16;
+        failures += floatBits(m::convertFromBFloat16(uint16_t(i))) != i << 16;
+        failures += bfloat16 != (nan ? (i | 0x40) : i);
+        cases += 4;
+    }
+}
+
+// Sampled floats, half of them random bit patterns (NaNs, Infs, subnormals and
+// huge values) and half spread over [-1.5, 1.5]. The batch kernels (SSE2 when
+// available) have to match the scalar conversions, which have to match the
+// rounding of a reference.
+static u::vector<float> sampleFloats(size_t count) {
+    u::vector<float> samples(count);
+    uint32_t state = 7;
+    for (size_t i = 0; i < count; i++) {
+        state = state * 1664525u + 1013904223u;
+        samples[i] = (i & 1) ? bitsFloat(state) : int32_t(state) * (1.5f / 2147483648.0f);
+    }
+    return samples;
+}
+
+static void testBatches(size_t &cases, size_t &failures) {
+    const u::vector<float> samples = sampleFloats(1 << 22);
+    const size_t count = samples.size();
+    const u::vector<uint8_t> unorm8 = m::convertToUnorm8(&samples[0], count);
+    const u::vector<int8_t> snorm8 = m::convertToSnorm8(&samples[0], count);
+    const u::vector<uint16_t> unorm16 = m::convertToUnorm16(&samples[0], count);
+    const u::vector<uint16_t> bfloat16 = m::convertToBFloat16(&samples[0], count);
+    for (size_t i = 0; i < count; i++) {
+        const float in = samples[i];
+        const float value = in != in ? 0.0f : in;
+        const float unit = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+        const float signedUnit = value < -1.0f ? -1.0f : (value > 1.0f ? 1.0f : value);
+        failures += unorm8[i] != m::convertToUnorm8(in) || unorm8[i] != uint8_t(nearbyintf(unit * 255.0f));
+        failures += snorm8[i] != m::convertToSnorm8(in) || snorm8[i] != int8_t(nearbyintf(signedUnit * 127.0f));
+        failures += unorm16[i] != m::convertToUnorm16(in) || unorm16[i] != uint16_t(nearbyintf(unit * 65535.0f));
+        failures += bfloat16[i] != m::convertToBFloat16(in);
+        cases += 4;
+    }
+}
+
+// The small float encoder used by R11G11B10F is generic over the mantissa
+// width, with 10 bits it has to agree with convertToHalfRNE on every positive
+// float. Every 11-bit and 10-bit code also has to decode and encode back to
+// itself, NaNs come back as the quiet NaN.
+static void testSmallFloats(size_t &cases, size_t &failures) {
+    const u::vector<float> samples = sampleFloats(1 << 22);
+    for (const float it : samples) {
+        const float in = fabsf(it);
+        if (in != in)
+            continue;
+        failures += m::convertToSmallFloat<10>(in) != m::convertToHalfRNE(in);
+        cases++;
+    }
+    for (uint32_t i = 0; i < 0x800; i++) {
+        const uint32_t code = m::convertToSmallFloat<6>(m::convertFromSmallFloat<6>(i));
+        failures += code != i && !(i > 0x7C0 && code == 0x7E0);
+        cases++;
+    }
+    for (uint32_t i = 0; i < 0x400; i++) {
+        const uint32_t code = m::convertToSmallFloat<5>(m::convertFromSmallFloat<5>(i));
+        failures += code != i && !(i > 0x3E0 && code == 0x3F0);
+        cases++;
+    }
+}
+
+// RGB9E5 codes decode to values which encode to codes decoding to the same
+// values, and sampled colors come back within half a step of the shared
+// exponent, which is at most 1/256th of the largest channel.
+static void testRGB9E5(size_t &cases, size_t &failures) {
+    for (uint32_t exponent = 0; exponent < 32; exponent++) {
+        for (uint32_t mantissa = 0; mantissa < 512; mantissa += 7) {
+            const uint32_t code = (exponent << 27) | ((mantissa / 2) << 18) | (5 << 9) | mantissa;
+            float rgb[3];
+            float back[3];
+            m::convertFromRGB9E5(code, rgb);
+            m::convertFromRGB9E5(m::convertToRGB9E5(rgb), back);
+            failures += memcmp(rgb, back, sizeof rgb) != 0;
+            cases++;
+        }
+    }
+    const u::vector<float> samples = sampleFloats(1 << 22);
+    for (size_t i = 0; i + 3 <= samples.size(); i += 3) {
+        const float rgb[3] = {
+            fabsf(samples[i + 0]) * 100.0f,
+            fabsf(samples[i + 1]),
+            fabsf(samples[i + 2]) * 1000.0f
+        };
+        if (!(rgb[0] < 60000.0f && rgb[1] < 60000.0f && rgb[2] < 60000.0f))
+            continue;
+        float back[3];
+        m::convertFromRGB9E5(m::convertToRGB9E5(rgb), back);
+        const float max = fmaxf(rgb[0], fmaxf(rgb[1], rgb[2]));
+        for (size_t j = 0; j < 3; j++)
+            failures += fabsf(back[j] - rgb[j]) > max / 256.0f + 1e-7f;
+        cases++;
+    }
+}
+
+int main() {
+    size_t cases = 0;
+    size_t failures = 0;
+    testToFloat(cases, failures);
+    testToHalfRNE(cases, failures);
+    testCodes(cases, failures);
+    testBatches(cases, failures);
+    testSmallFloats(cases, failures);
+    testRGB9E5(cases, failures);
+    printf("%zu cases, %zu failures\n", cases, failures);
+    return failures != 0;
+}
+#endif
+
+#ifdef HALF_FLOAT_BENCHMARK
+#include <stdio.h>
+
+#include <chrono>
+#include <vector>
+
+// Converts a buffer twice the size of the last level cache with 1, 2, 4, ...
+// up to all hardware threads, once writing through the cache and once with
+// non-temporal stores. GB/s counts the bytes read and written.
+int main() {
+    const size_t length = 2 * m::cacheSize() / sizeof(float);
+    std::vector<float> in(length);
+    std::vector<m::half> out(length);
+    for (size_t i = 0; i < length; i++)
+        in[i] = float(i % 65536) * 0.25f - 8192.0f;
+
+    const size_t hardware = std::thread::hardware_concurrency();
+    const char *names[] = { "cached", "non-temporal" };
+    printf("%zu MiB of floats\n", length * sizeof(float) >> 20);
+    for (size_t stream = 0; stream < 2; stream++) {
+        for (size_t threads = 1; threads <= (hardware > 1 ? hardware : 1); threads *= 2) {
+            size_t runs = 0;
+            std::chrono::duration<double> elapsed(0);
+            do {
+                const auto start = std::chrono::steady_clock::now();
+                m::convertToHalf<true>(&in[0], &out[0], length, threads, stream);
+                elapsed += std::chrono::steady_clock::now() - start;
+                runs++;
+            } while (elapsed.count() < 1.0);
+            const double bytes = double(length) * (sizeof(float) + sizeof(m::half)) * runs;
+            printf("%12s %2zu threads: ~%.2f GB/s\n", names[stream], threads,
+                bytes / elapsed.count() / 1e9);
+        }
+    }
+    return 0;
+}
+#endif
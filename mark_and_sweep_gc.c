@@ -5,7 +5,7 @@
  * to compile gcc -std=gnu99 file.c -o test
  * to run test ./test.
  *
- * see line 224 for indepth explination and example.
+ * see line 369 for indepth explination and example.
  */
 
 /* begin header */
@@ -41,15 +41,49 @@ char *gc_strdup(gc_t *gc, const char *string);
 #define GC_ROOTS 32
 #define GC_MAGIC 0x47
 
+/*
+ * Objects are allocated out of pages of equal-sized slots, one size class
+ * per page. The slot sizes include the object header and are all multiples
+ * of 16 bytes. Objects too large for any class get a page to themselves.
+ */
+#define GC_PAGE_SIZE 65536
+#define GC_GRANULE   16
+#define GC_CLASSES   (sizeof(gc_class_sizes) / sizeof(*gc_class_sizes))
+#define GC_LARGE     GC_CLASSES
+#define GC_MAX_SIZE  2048
+
+static const size_t gc_class_sizes[] = {
+    32,   48,   64,   80,   96,   112,  128,
+    160,  192,  224,  256,  320,  384,  448,
+    512,  640,  768,  896,  1024, 1280, 1536,
+    1792, 2048
+};
+
+typedef struct gc_page_s gc_page_t;
+
 typedef struct {
-    gc_byte_t magic;
-    gc_byte_t referenced;
-    gc_byte_t children;
-    gc_byte_t index;
-    void     *next;
-    void     *prev;
+    gc_byte_t  magic;
+    gc_byte_t  referenced;
+    gc_byte_t  children;
+    gc_byte_t  index;
+    gc_page_t *page;
+    void      *prev; /* back link while marking, next free slot when free */
 } gc_object_t;
 
+struct gc_page_s {
+    gc_object_t *free;  /* free slots of this page */
+    gc_page_t   *next;  /* next page of the class with free slots */
+    size_t       size;  /* slot size */
+    size_t       slots;
+    size_t       used;
+    size_t       cls;   /* size class or GC_LARGE */
+    size_t       index; /* in gc->pages */
+};
+
+/* Slots begin after the page header, aligned to a granule */
+#define GC_PAGE_HEADER \
+    ((sizeof(gc_page_t) + GC_GRANULE - 1) & ~(size_t)(GC_GRANULE - 1))
+
 typedef struct {
     void *beg;
     void *end;
@@ -60,25 +94,96 @@ typedef struct {
     size_t size;
 } gc_root_t;
 
+typedef struct {
+    gc_page_t **data;
+    size_t      size;
+    size_t      capacity;
+} gc_pages_t;
+
 struct gc_s {
-    gc_object_t *head;
-    gc_root_t    root;
-    gc_heap_t    heap;
-    size_t       count;
-    size_t       offset;
+    gc_page_t  *classes[GC_CLASSES]; /* pages with free slots by class */
+    gc_byte_t   lookup[GC_MAX_SIZE / GC_GRANULE + 1]; /* granules to class */
+    gc_pages_t  pages;
+    gc_root_t   root;
+    gc_heap_t   heap;
+    size_t      count;
+    size_t      offset;
 };
 
+static gc_object_t *gc_slot(gc_page_t *page, size_t slot) {
+    return (gc_object_t*)((unsigned char *)page + GC_PAGE_HEADER + slot * page->size);
+}
+
+static gc_page_t *gc_page_create(gc_t *gc, size_t cls, size_t size) {
+    /* Pages of a class hold as many slots as fit, a large page holds one */
+    size_t slots = 1;
+    size_t bytes = GC_PAGE_HEADER + size;
+    if (cls != GC_LARGE) {
+        slots = (GC_PAGE_SIZE - GC_PAGE_HEADER) / size;
+        bytes = GC_PAGE_SIZE;
+    }
+
+    if (gc->pages.size == gc->pages.capacity) {
+        size_t capacity = gc->pages.capacity ? gc->pages.capacity * 2 : 16;
+        gc_page_t **data = realloc(gc->pages.data, capacity * sizeof(*data));
+        if (!data)
+            return NULL;
+        gc->pages.data     = data;
+        gc->pages.capacity = capacity;
+    }
+
+    /* Fresh pages are zeroed so the slots need no clearing */
+    gc_page_t *page = calloc(1, bytes);
+    if (!page)
+        return NULL;
+    page->size  = size;
+    page->slots = slots;
+    page->cls   = cls;
+    page->index = gc->pages.size;
+    gc->pages.data[gc->pages.size++] = page;
+
+    /* Link the free slots in address order */
+    for (size_t i = slots; i-- > 0; ) {
+        gc_object_t *object = gc_slot(page, i);
+        object->page = page;
+        object->prev = page->free;
+        page->free   = object;
+    }
+
+    gc_object_t *last = gc_slot(page, slots - 1);
+    if ((uintptr_t)page < (uintptr_t)gc->heap.beg || !gc->heap.beg)
+        gc->heap.beg = page;
+    if ((uintptr_t)last > (uintptr_t)gc->heap.end)
+        gc->heap.end = last;
+
+    return page;
+}
+
+static void gc_page_destroy(gc_t *gc, gc_page_t *page) {
+    /* Move the last page into the hole */
+    gc_page_t *last = gc->pages.data[--gc->pages.size];
+    last->index = page->index;
+    gc->pages.data[page->index] = last;
+    free(page);
+}
+
 void gc_free(gc_t *gc, void *pointer) {
     gc_object_t *object = (gc_object_t*)pointer - 1;
-    if (object->prev)
-        ((gc_object_t*)object->prev)->next = object->next;
-    else
-        gc->head = object->next;
-    if (object->next)
-        ((gc_object_t*)object->next)->prev = object->prev;
+    gc_page_t   *page   = object->page;
     object->magic = 0;
     gc->count--;
-    free(object);
+    if (page->cls == GC_LARGE) {
+        gc_page_destroy(gc, page);
+        return;
+    }
+    /* A full page is not in the class list, it is about to have room */
+    if (!page->free) {
+        page->next = gc->classes[page->cls];
+        gc->classes[page->cls] = page;
+    }
+    object->prev = page->free;
+    page->free   = object;
+    page->used--;
 }
 
 void gc_root(gc_t *gc, void *root) {
@@ -138,63 +243,94 @@ size_t gc_collect(gc_t *gc) {
             gc_mark(gc, (gc_object_t*) *gc->root.data[i] - 1);
     }
 
-    /* Sweep */
-    gc_object_t *object = gc->head;
-    gc_object_t *next   = NULL;
-    gc_object_t *prev   = NULL;
-    for (; object; object = next) {
-        next = object->next;
-        if (object->referenced == 0) {
-            gc_free(gc, object + 1);
-            ++collected;
+    /*
+     * Sweep every page linearly, the free lists of the pages and classes are
+     * rebuilt on the way. Pages left empty are released.
+     */
+    memset(gc->classes, 0, sizeof(gc->classes));
+    for (size_t i = 0; i < gc->pages.size; ) {
+        gc_page_t *page = gc->pages.data[i];
+        page->free = NULL;
+        page->used = 0;
+        for (size_t j = page->slots; j-- > 0; ) {
+            gc_object_t *object = gc_slot(page, j);
+            if (object->magic == GC_MAGIC) {
+                if (object->referenced) {
+                    object->referenced = 0;
+                    object->index      = 0;
+                    page->used++;
+                    continue;
+                }
+                object->magic = 0;
+                gc->count--;
+                ++collected;
+            }
+            object->prev = page->free;
+            page->free   = object;
+        }
+        if (page->used == 0) {
+            /* The last page takes this index, sweep it next */
+            gc_page_destroy(gc, page);
             continue;
         }
-        object->prev       = prev;
-        object->referenced = 0;
-        object->index      = 0;
-        prev               = object;
+        if (page->free && page->cls != GC_LARGE) {
+            page->next = gc->classes[page->cls];
+            gc->classes[page->cls] = page;
+        }
+        i++;
     }
     return collected;
 }
 
 void *gc_alloc(gc_t *gc, size_t size, gc_byte_t children) {
-    gc_object_t *object;
-    if (!(object = malloc(sizeof(*object) + size)))
-        return NULL;
+    size_t total = sizeof(gc_object_t) + size;
+    size_t cls   = GC_LARGE;
+    if (total <= GC_MAX_SIZE)
+        cls = gc->lookup[(total + GC_GRANULE - 1) / GC_GRANULE];
+
+    gc_page_t *page = (cls == GC_LARGE) ? NULL : gc->classes[cls];
+    if (!page) {
+        if (!(page = gc_page_create(gc, cls, cls == GC_LARGE ? total : gc_class_sizes[cls])))
+            return NULL;
+        if (cls != GC_LARGE)
+            gc->classes[cls] = page;
+    }
 
-    if ((uintptr_t)object < (uintptr_t)gc->heap.beg)
-        gc->heap.beg = object;
-    if ((uintptr_t)object > (uintptr_t)gc->heap.end)
-        gc->heap.end = object;
+    gc_object_t *object = page->free;
+    page->free = object->prev;
+    page->used++;
+    /* A full page leaves the class list until something in it is freed */
+    if (!page->free && cls != GC_LARGE)
+        gc->classes[cls] = page->next;
 
-    memset(object, 0, sizeof(*object) + size);
+    /* Only the requested bytes of a reused slot need clearing */
+    memset(object + 1, 0, size);
     object->magic      = GC_MAGIC;
     object->referenced = 0;
     object->children   = (gc_byte_t)children;
     object->index      = 0;
-    object->next       = gc->head;
     object->prev       = NULL;
 
-    if (gc->head)
-        gc->head->prev = object;
-    gc->head = object;
-
     gc->count++;
     return object + 1;
 }
 
 void *gc_realloc(gc_t *gc, void *ptr, size_t size) {
-    size += sizeof(gc_object_t);
-    void *moved = realloc(ptr, size);
-    gc_object_t *object = moved;
+    if (!ptr)
+        return gc_alloc(gc, size, 0);
 
-    /* If it moved */
-    if ((uintptr_t)object < (uintptr_t)gc->heap.beg)
-        gc->heap.beg = object;
-    if ((uintptr_t)object > (uintptr_t)gc->heap.end)
-        gc->heap.end = object;
+    /* Still fits in the slot */
+    gc_object_t *object   = (gc_object_t*)ptr - 1;
+    size_t       capacity = object->page->size - sizeof(gc_object_t);
+    if (size <= capacity && object->page->cls != GC_LARGE)
+        return ptr;
 
-    return object + 1;
+    void *moved = gc_alloc(gc, size, object->children);
+    if (!moved)
+        return NULL;
+    memcpy(moved, ptr, size < capacity ? size : capacity);
+    gc_free(gc, ptr);
+    return moved;
 }
 
 char *gc_strdup(gc_t *gc, const char *string) {
@@ -209,13 +345,22 @@ gc_t *gc_create(size_t offset) {
     if (!gc)
         return NULL;
 
+    /* Smallest class which fits each amount of granules */
+    size_t cls = 0;
+    for (size_t i = 0; i < sizeof(gc->lookup); i++) {
+        while (gc_class_sizes[cls] < i * GC_GRANULE)
+            cls++;
+        gc->lookup[i] = (gc_byte_t)cls;
+    }
+
     gc->offset = offset;
     return gc;
 }
 
 void gc_destroy(gc_t *gc) {
-    memset(gc->root.data, 0, sizeof(gc->root.data) / sizeof(void*));
+    memset(gc->root.data, 0, sizeof(gc->root.data));
     gc_collect(gc);
+    free(gc->pages.data);
     free(gc);
 }
 
@@ -3,6 +3,15 @@
 #ifdef __SSE2__
 #   include <xmmintrin.h>
 #endif
+#ifdef __AVX__
+#   include <immintrin.h>
+#endif
+
+#include <stdint.h>
+#include <string.h>
+
+#include <thread>
+#include <vector>
 
 #include "m_vec3.h"
 
@@ -14,6 +23,7 @@ struct alignas(16) ray {
     __m128 direction;
     __m128 invert;
 #else
+struct ray {
     vec3 origin;
     vec3 direction;
     vec3 invert;
@@ -36,9 +46,9 @@ inline vec3 ray::where(float distance) const {
     const __m128 scale = _mm_mul_ps(direction, _mm_set_ps(0.0f, distance, distance, distance));
     const union {
         __m128 add;
-        float w[4]; // w, z, y, x
+        float w[4]; // x, y, z, w
     } add = { _mm_add_ps(origin, scale) };
-    return vec3(add.w[3], add.w[2], add.w[1]);
+    return vec3(add.w[0], add.w[1], add.w[2]);
 }
 #else
 inline ray::ray(const vec3 &origin, const vec3 &direction)
@@ -53,6 +63,55 @@ inline vec3 ray::where(float distance) const {
 }
 #endif
 
+// Ray with the sign of each component of the direction precomputed. The box
+// test selects the near and far plane of each slab with it instead of taking
+// the min and max of both, and tfar is scaled up slightly so rounding can't
+// turn a ray that grazes a box into a miss (Ize, Robust BVH Ray Traversal.)
+// A ray exactly in the plane of a slab counts as inside it, the same as
+// bbox::intersect with a ray.
+#ifdef __SSE2__
+struct alignas(16) signedRay {
+    __m128 origin;
+    __m128 invert;
+    // All bits set in components where the direction is negative, -0 included
+    __m128 sign;
+#else
+struct signedRay {
+    vec3 origin;
+    vec3 invert;
+    int sign[3];
+#endif
+
+    signedRay(const ray &r);
+};
+
+// 1 + 2 gamma(3), gamma(n) = n * eps / (1 - n * eps) bounds the rounding error
+// of the slab distances.
+static const float kRobust = 1.00000036f;
+
+#ifdef __SSE2__
+inline signedRay::signedRay(const ray &r)
+    : origin(r.origin)
+    , invert(r.invert)
+    , sign(_mm_castsi128_ps(_mm_srai_epi32(_mm_castps_si128(r.invert), 31)))
+{
+}
+#else
+inline signedRay::signedRay(const ray &r)
+    : origin(r.origin)
+    , invert(r.invert)
+{
+    sign[0] = signbit(invert.x) ? 1 : 0;
+    sign[1] = signbit(invert.y) ? 1 : 0;
+    sign[2] = signbit(invert.z) ? 1 : 0;
+}
+#endif
+
+// Same as _mm_min_ps and _mm_max_ps, the second operand when either is NaN,
+// so all paths filter NaNs the same way.
+static inline float minps(float a, float b) { return a < b ? a : b; }
+static inline float maxps(float a, float b) { return a > b ? a : b; }
+
 #ifdef __SSE2__
 struct alignas(16) bbox {
     __m128 min;
@@ -70,6 +129,7 @@ struct bbox {
     bbox(const vec3 &point);
 
     bool intersect(const ray &r, float &tnear, float &tfar) const;
+    bool intersect(const signedRay &r, float &tnear, float &tfar) const;
 };
 
 #ifdef __SSE2__
@@ -132,6 +192,36 @@ inline bool bbox::intersect(const ray &r, float &tnear, float &tfar) const {
 
     return hit;
 }
+
+inline bool bbox::intersect(const signedRay &r, float &tnear, float &tfar) const {
+    // Swap min and max of the slabs the ray goes through backwards
+    const __m128 swap = _mm_and_ps(_mm_xor_ps(min, max), r.sign);
+    const __m128 nearPlane = _mm_xor_ps(min, swap);
+    const __m128 farPlane = _mm_xor_ps(max, swap);
+
+    // A NaN is a ray in the plane of the slab, which doesn't limit either
+    __m128 lmin = _mm_mul_ps(_mm_sub_ps(nearPlane, r.origin), r.invert);
+    __m128 lmax = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(farPlane, r.origin), r.invert), _mm_set1_ps(kRobust));
+    lmin = _mm_max_ps(lmin, kMinusInf);
+    lmax = _mm_min_ps(lmax, kPlusInf);
+
+    const __m128 lmax0 = _mm_shuffle_ps(lmax, lmax, 0x39);
+    const __m128 lmin0 = _mm_shuffle_ps(lmin, lmin, 0x39);
+    lmax = _mm_min_ss(lmax, lmax0);
+    lmin = _mm_max_ss(lmin, lmin0);
+
+    const __m128 lmax1 = _mm_movehl_ps(lmax, lmax);
+    const __m128 lmin1 = _mm_movehl_ps(lmin, lmin);
+    lmax = _mm_min_ss(lmax, lmax1);
+    lmin = _mm_max_ss(lmin, lmin1);
+
+    const bool hit = _mm_comige_ss(lmax, _mm_setzero_ps()) & _mm_comige_ss(lmax, lmin);
+
+    _mm_store_ss((float *)&tnear, lmin);
+    _mm_store_ss((float *)&tfar, lmax);
+
+    return hit;
+}
 #else
 inline bbox::bbox(const vec3 &min, const vec3 &max)
     : min(min)
@@ -147,18 +237,878 @@ inline bbox::bbox(const vec3 &point)
 }
 
 inline bool bbox::intersect(const ray &r, float &tnear, float &tfar) const {
-    const vec3 c0 = r.inverse * (min - r.origin);
-    const vec3 c1 = r.inverse * (max - r.origin);
-    const vec3 boxMin = u::min(c1, c0);
-    const vec3 boxMax = u::max(c1, c0);
+    const float inf = -logf(0.0f);
+    const vec3 c0 = r.invert * (min - r.origin);
+    const vec3 c1 = r.invert * (max - r.origin);
+    const float l1[3] = { c0.x, c0.y, c0.z };
+    const float l2[3] = { c1.x, c1.y, c1.z };
+
+    // Filter out NaNs the same way as the SSE version
+    tnear = -inf;
+    tfar = inf;
+    for (size_t i = 0; i < 3; i++) {
+        tnear = maxps(tnear, minps(maxps(l1[i], -inf), maxps(l2[i], -inf)));
+        tfar = minps(tfar, maxps(minps(l1[i], inf), minps(l2[i], inf)));
+    }
+
+    return tfar >= 0.0f && tfar >= tnear;
+}
+
+inline bool bbox::intersect(const signedRay &r, float &tnear, float &tfar) const {
+    const float inf = -logf(0.0f);
+    const float lo[3] = { min.x, min.y, min.z };
+    const float hi[3] = { max.x, max.y, max.z };
+    const float origin[3] = { r.origin.x, r.origin.y, r.origin.z };
+    const float invert[3] = { r.invert.x, r.invert.y, r.invert.z };
+
+    tnear = -inf;
+    tfar = inf;
+    for (size_t i = 0; i < 3; i++) {
+        const float lmin = ((r.sign[i] ? hi[i] : lo[i]) - origin[i]) * invert[i];
+        const float lmax = ((r.sign[i] ? lo[i] : hi[i]) - origin[i]) * invert[i] * kRobust;
+        tnear = maxps(tnear, maxps(lmin, -inf));
+        tfar = minps(tfar, minps(lmax, inf));
+    }
+
+    return tfar >= 0.0f && tfar >= tnear;
+}
+#endif
+
+
+// Packets of N rays or N boxes in structure of arrays form for testing many
+// at once: one ray against the children of a node or a packet of rays against
+// one box. Broadcasting a single ray or box fills every lane with it. Unlike
+// ray and bbox no lane is wasted on w and there is no horizontal reduction,
+// each lane gets its own tnear, tfar and bit in the hit mask. Lanes that are
+// not used should be ignored in the mask by the caller.
+//
+// SSE2 is used for four, AVX for eight and AVX-512 for sixteen, otherwise
+// they're tested one lane at a time.
+
+// Read the components of a ray or bbox member
+#ifdef __SSE2__
+static inline void components(__m128 value, float (&out)[4]) {
+    _mm_storeu_ps(out, value);
+}
+#else
+static inline void components(const vec3 &value, float (&out)[4]) {
+    out[0] = value.x;
+    out[1] = value.y;
+    out[2] = value.z;
+}
+#endif
+
+template <size_t N>
+struct alignas(16) rayN {
+    float origin[3][N];
+    float invert[3][N];
+
+    rayN() = default;
+    rayN(const ray &r);
+
+    void set(size_t lane, const ray &r);
+};
+
+// The same ray in every lane with the signs of its direction, for one ray
+// against the children of a node. The signs pick which of min and max is the
+// near plane for all lanes at once.
+template <size_t N>
+struct alignas(16) signedRayN : rayN<N> {
+    int sign[3];
+
+    signedRayN(const ray &r);
+};
+
+template <size_t N>
+struct alignas(16) bboxN {
+    float min[3][N];
+    float max[3][N];
+
+    bboxN() = default;
+    bboxN(const bbox &box);
+
+    void set(size_t lane, const bbox &box);
+
+    // Bit i of the result is set when the ray in lane i hits the box in lane i
+    unsigned intersect(const rayN<N> &r, float *tnear, float *tfar) const;
+    // Robust the same way as bbox::intersect with a signedRay
+    unsigned intersect(const signedRayN<N> &r, float *tnear, float *tfar) const;
+};
+
+typedef rayN<4> ray4;
+typedef rayN<8> ray8;
+typedef rayN<16> ray16;
+typedef bboxN<4> bbox4;
+typedef bboxN<8> bbox8;
+typedef bboxN<16> bbox16;
+
+template <size_t N>
+inline rayN<N>::rayN(const ray &r) {
+    for (size_t i = 0; i < N; i++)
+        set(i, r);
+}
+
+template <size_t N>
+inline void rayN<N>::set(size_t lane, const ray &r) {
+    float o[4];
+    float d[4];
+    components(r.origin, o);
+    components(r.invert, d);
+    for (size_t i = 0; i < 3; i++) {
+        origin[i][lane] = o[i];
+        invert[i][lane] = d[i];
+    }
+}
+
+template <size_t N>
+inline signedRayN<N>::signedRayN(const ray &r)
+    : rayN<N>(r)
+{
+    for (size_t i = 0; i < 3; i++)
+        sign[i] = signbit(this->invert[i][0]) ? 1 : 0;
+}
+
+template <size_t N>
+inline bboxN<N>::bboxN(const bbox &box) {
+    for (size_t i = 0; i < N; i++)
+        set(i, box);
+}
+
+template <size_t N>
+inline void bboxN<N>::set(size_t lane, const bbox &box) {
+    float lo[4];
+    float hi[4];
+    components(box.min, lo);
+    components(box.max, hi);
+    for (size_t i = 0; i < 3; i++) {
+        min[i][lane] = lo[i];
+        max[i][lane] = hi[i];
+    }
+}
+
+template <size_t N>
+inline unsigned bboxN<N>::intersect(const rayN<N> &r, float *tnear, float *tfar) const {
+    const float inf = -logf(0.0f);
+    unsigned hits = 0;
+    for (size_t i = 0; i < N; i++) {
+        float lmin = -inf;
+        float lmax = inf;
+        for (size_t a = 0; a < 3; a++) {
+            const float l1 = (min[a][i] - r.origin[a][i]) * r.invert[a][i];
+            const float l2 = (max[a][i] - r.origin[a][i]) * r.invert[a][i];
+            lmin = maxps(lmin, minps(maxps(l1, -inf), maxps(l2, -inf)));
+            lmax = minps(lmax, maxps(minps(l1, inf), minps(l2, inf)));
+        }
+        tnear[i] = lmin;
+        tfar[i] = lmax;
+        if (lmax >= 0.0f && lmax >= lmin)
+            hits |= 1u << i;
+    }
+    return hits;
+}
+
+template <size_t N>
+inline unsigned bboxN<N>::intersect(const signedRayN<N> &r, float *tnear, float *tfar) const {
+    const float inf = -logf(0.0f);
+    unsigned hits = 0;
+    for (size_t i = 0; i < N; i++) {
+        float lmin = -inf;
+        float lmax = inf;
+        for (size_t a = 0; a < 3; a++) {
+            const float *const nearPlane = r.sign[a] ? max[a] : min[a];
+            const float *const farPlane = r.sign[a] ? min[a] : max[a];
+            // The running distances come second so a NaN is dropped
+            lmin = maxps((nearPlane[i] - r.origin[a][i]) * r.invert[a][i], lmin);
+            lmax = minps((farPlane[i] - r.origin[a][i]) * r.invert[a][i] * kRobust, lmax);
+        }
+        tnear[i] = lmin;
+        tfar[i] = lmax;
+        if (lmax >= 0.0f && lmax >= lmin)
+            hits |= 1u << i;
+    }
+    return hits;
+}
+
+#ifdef __SSE2__
+template <>
+inline unsigned bboxN<4>::intersect(const rayN<4> &r, float *tnear, float *tfar) const {
+    __m128 lmin = kMinusInf;
+    __m128 lmax = kPlusInf;
+    for (size_t a = 0; a < 3; a++) {
+        const __m128 position = _mm_loadu_ps(r.origin[a]);
+        const __m128 invert = _mm_loadu_ps(r.invert[a]);
+        const __m128 l1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(min[a]), position), invert);
+        const __m128 l2 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(max[a]), position), invert);
+        // Filter out NaNs the same way as bbox::intersect
+        lmin = _mm_max_ps(lmin, _mm_min_ps(_mm_max_ps(l1, kMinusInf), _mm_max_ps(l2, kMinusInf)));
+        lmax = _mm_min_ps(lmax, _mm_max_ps(_mm_min_ps(l1, kPlusInf), _mm_min_ps(l2, kPlusInf)));
+    }
+    _mm_storeu_ps(tnear, lmin);
+    _mm_storeu_ps(tfar, lmax);
+    const __m128 hit = _mm_and_ps(_mm_cmpge_ps(lmax, _mm_setzero_ps()), _mm_cmpge_ps(lmax, lmin));
+    return _mm_movemask_ps(hit);
+}
+
+template <>
+inline unsigned bboxN<4>::intersect(const signedRayN<4> &r, float *tnear, float *tfar) const {
+    const __m128 robust = _mm_set1_ps(kRobust);
+    __m128 lmin = kMinusInf;
+    __m128 lmax = kPlusInf;
+    for (size_t a = 0; a < 3; a++) {
+        const float *const nearPlane = r.sign[a] ? max[a] : min[a];
+        const float *const farPlane = r.sign[a] ? min[a] : max[a];
+        const __m128 position = _mm_loadu_ps(r.origin[a]);
+        const __m128 invert = _mm_loadu_ps(r.invert[a]);
+        const __m128 l1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(nearPlane), position), invert);
+        const __m128 l2 = _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(farPlane), position), invert), robust);
+        // The running distances come second so a NaN is dropped
+        lmin = _mm_max_ps(l1, lmin);
+        lmax = _mm_min_ps(l2, lmax);
+    }
+    _mm_storeu_ps(tnear, lmin);
+    _mm_storeu_ps(tfar, lmax);
+    const __m128 hit = _mm_and_ps(_mm_cmpge_ps(lmax, _mm_setzero_ps()), _mm_cmpge_ps(lmax, lmin));
+    return _mm_movemask_ps(hit);
+}
+#endif
+
+#ifdef __AVX__
+template <>
+inline unsigned bboxN<8>::intersect(const rayN<8> &r, float *tnear, float *tfar) const {
+    const __m256 plusInf = _mm256_set1_ps(kInf);
+    const __m256 minusInf = _mm256_set1_ps(-kInf);
+    __m256 lmin = minusInf;
+    __m256 lmax = plusInf;
+    for (size_t a = 0; a < 3; a++) {
+        const __m256 position = _mm256_loadu_ps(r.origin[a]);
+        const __m256 invert = _mm256_loadu_ps(r.invert[a]);
+        const __m256 l1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(min[a]), position), invert);
+        const __m256 l2 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(max[a]), position), invert);
+        lmin = _mm256_max_ps(lmin, _mm256_min_ps(_mm256_max_ps(l1, minusInf), _mm256_max_ps(l2, minusInf)));
+        lmax = _mm256_min_ps(lmax, _mm256_max_ps(_mm256_min_ps(l1, plusInf), _mm256_min_ps(l2, plusInf)));
+    }
+    _mm256_storeu_ps(tnear, lmin);
+    _mm256_storeu_ps(tfar, lmax);
+    const __m256 hit = _mm256_and_ps(_mm256_cmp_ps(lmax, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                     _mm256_cmp_ps(lmax, lmin, _CMP_GE_OQ));
+    return _mm256_movemask_ps(hit);
+}
 
-    tnear = u::max(u::max(boxMin.x, boxMin.y), boxMin.z);
-    tfar = u::max(u::max(boxMax.x, boxMax.y), boxMax.z);
+template <>
+inline unsigned bboxN<8>::intersect(const signedRayN<8> &r, float *tnear, float *tfar) const {
+    const __m256 robust = _mm256_set1_ps(kRobust);
+    __m256 lmin = _mm256_set1_ps(-kInf);
+    __m256 lmax = _mm256_set1_ps(kInf);
+    for (size_t a = 0; a < 3; a++) {
+        const float *const nearPlane = r.sign[a] ? max[a] : min[a];
+        const float *const farPlane = r.sign[a] ? min[a] : max[a];
+        const __m256 position = _mm256_loadu_ps(r.origin[a]);
+        const __m256 invert = _mm256_loadu_ps(r.invert[a]);
+        const __m256 l1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(nearPlane), position), invert);
+        const __m256 l2 = _mm256_mul_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(farPlane), position), invert), robust);
+        lmin = _mm256_max_ps(l1, lmin);
+        lmax = _mm256_min_ps(l2, lmax);
+    }
+    _mm256_storeu_ps(tnear, lmin);
+    _mm256_storeu_ps(tfar, lmax);
+    const __m256 hit = _mm256_and_ps(_mm256_cmp_ps(lmax, _mm256_setzero_ps(), _CMP_GE_OQ),
+                                     _mm256_cmp_ps(lmax, lmin, _CMP_GE_OQ));
+    return _mm256_movemask_ps(hit);
+}
+#endif
+
+#ifdef __AVX512F__
+template <>
+inline unsigned bboxN<16>::intersect(const rayN<16> &r, float *tnear, float *tfar) const {
+    const __m512 plusInf = _mm512_set1_ps(kInf);
+    const __m512 minusInf = _mm512_set1_ps(-kInf);
+    __m512 lmin = minusInf;
+    __m512 lmax = plusInf;
+    for (size_t a = 0; a < 3; a++) {
+        const __m512 position = _mm512_loadu_ps(r.origin[a]);
+        const __m512 invert = _mm512_loadu_ps(r.invert[a]);
+        const __m512 l1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(min[a]), position), invert);
+        const __m512 l2 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(max[a]), position), invert);
+        lmin = _mm512_max_ps(lmin, _mm512_min_ps(_mm512_max_ps(l1, minusInf), _mm512_max_ps(l2, minusInf)));
+        lmax = _mm512_min_ps(lmax, _mm512_max_ps(_mm512_min_ps(l1, plusInf), _mm512_min_ps(l2, plusInf)));
+    }
+    _mm512_storeu_ps(tnear, lmin);
+    _mm512_storeu_ps(tfar, lmax);
+    const __mmask16 hit = _mm512_cmp_ps_mask(lmax, _mm512_setzero_ps(), _CMP_GE_OQ)
+                        & _mm512_cmp_ps_mask(lmax, lmin, _CMP_GE_OQ);
+    return hit;
+}
 
-    return !(tnear > tfar) && tfar > 0;
+template <>
+inline unsigned bboxN<16>::intersect(const signedRayN<16> &r, float *tnear, float *tfar) const {
+    const __m512 robust = _mm512_set1_ps(kRobust);
+    __m512 lmin = _mm512_set1_ps(-kInf);
+    __m512 lmax = _mm512_set1_ps(kInf);
+    for (size_t a = 0; a < 3; a++) {
+        const float *const nearPlane = r.sign[a] ? max[a] : min[a];
+        const float *const farPlane = r.sign[a] ? min[a] : max[a];
+        const __m512 position = _mm512_loadu_ps(r.origin[a]);
+        const __m512 invert = _mm512_loadu_ps(r.invert[a]);
+        const __m512 l1 = _mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(nearPlane), position), invert);
+        const __m512 l2 = _mm512_mul_ps(_mm512_mul_ps(_mm512_sub_ps(_mm512_loadu_ps(farPlane), position), invert), robust);
+        lmin = _mm512_max_ps(l1, lmin);
+        lmax = _mm512_min_ps(l2, lmax);
+    }
+    _mm512_storeu_ps(tnear, lmin);
+    _mm512_storeu_ps(tfar, lmax);
+    const __mmask16 hit = _mm512_cmp_ps_mask(lmax, _mm512_setzero_ps(), _CMP_GE_OQ)
+                        & _mm512_cmp_ps_mask(lmax, lmin, _CMP_GE_OQ);
+    return hit;
 }
 #endif
 
+// Culling many boxes at once. Boxes are kept in structure of arrays form and
+// tested against a frustum, a sphere or another box as many at a time as the
+// widest vector unit allows. The result is the indices of the boxes that are
+// not culled, in order. The boxes can be split across threads, each thread
+// culls a contiguous share straight into the output and the shares are packed
+// together after.
+struct bboxes {
+    void push_back(const bbox &box);
+    void clear();
+    size_t size() const;
+
+    std::vector<float> min[3];
+    std::vector<float> max[3];
+};
+
+// Planes are a, b, c, d with a*x + b*y + c*z + d >= 0 on the inside
+struct frustum {
+    float planes[6][4];
+};
+
+// indices must have room for boxes.size() entries even when few boxes are
+// kept, with threads each share is written at its own offset before packing.
+// The number of indices written is returned.
+//
+// Indices of the boxes that are at least partially inside the frustum, some
+// boxes just outside near the corners are kept too.
+size_t cull(const bboxes &boxes, const frustum &f, uint32_t *indices, size_t threads = 1);
+// Indices of the boxes that overlap the sphere
+size_t cull(const bboxes &boxes, const vec3 &center, float radius, uint32_t *indices, size_t threads = 1);
+// Indices of the boxes that overlap the box
+size_t cull(const bboxes &boxes, const bbox &box, uint32_t *indices, size_t threads = 1);
+
+inline void bboxes::push_back(const bbox &box) {
+    float lo[4];
+    float hi[4];
+    components(box.min, lo);
+    components(box.max, hi);
+    for (size_t i = 0; i < 3; i++) {
+        min[i].push_back(lo[i]);
+        max[i].push_back(hi[i]);
+    }
 }
 
+inline void bboxes::clear() {
+    for (size_t i = 0; i < 3; i++) {
+        min[i].clear();
+        max[i].clear();
+    }
+}
+
+inline size_t bboxes::size() const {
+    return min[0].size();
+}
+
+// The operations the culling tests need for each vector width. Comparisons
+// give a mask with a bit per lane and compact writes the index of each lane
+// in the mask to out, returning how many were written.
+struct lanes1 {
+    typedef float type;
+    static constexpr size_t kWidth = 1;
+    static type load(const float *p) { return *p; }
+    static type set(float value) { return value; }
+    static type add(type a, type b) { return a + b; }
+    static type sub(type a, type b) { return a - b; }
+    static type mul(type a, type b) { return a * b; }
+    static type max(type a, type b) { return maxps(a, b); }
+    static unsigned ge(type a, type b) { return a >= b; }
+    static unsigned le(type a, type b) { return a <= b; }
+    static size_t compact(uint32_t *out, uint32_t base, unsigned mask) {
+        *out = base;
+        return mask;
+    }
+};
+
+#ifdef __SSE2__
+struct lanes4 {
+    typedef __m128 type;
+    static constexpr size_t kWidth = 4;
+    static type load(const float *p) { return _mm_loadu_ps(p); }
+    static type set(float value) { return _mm_set1_ps(value); }
+    static type add(type a, type b) { return _mm_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm_mul_ps(a, b); }
+    static type max(type a, type b) { return _mm_max_ps(a, b); }
+    static unsigned ge(type a, type b) { return _mm_movemask_ps(_mm_cmpge_ps(a, b)); }
+    static unsigned le(type a, type b) { return _mm_movemask_ps(_mm_cmple_ps(a, b)); }
+    // Every index is written, only the ones in the mask move out along
+    static size_t compact(uint32_t *out, uint32_t base, unsigned mask) {
+        size_t count = 0;
+        for (size_t i = 0; i < kWidth; i++) {
+            out[count] = base + uint32_t(i);
+            count += (mask >> i) & 1;
+        }
+        return count;
+    }
+};
+#endif
+
+#ifdef __AVX__
+struct lanes8 {
+    typedef __m256 type;
+    static constexpr size_t kWidth = 8;
+    static type load(const float *p) { return _mm256_loadu_ps(p); }
+    static type set(float value) { return _mm256_set1_ps(value); }
+    static type add(type a, type b) { return _mm256_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm256_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm256_mul_ps(a, b); }
+    static type max(type a, type b) { return _mm256_max_ps(a, b); }
+    static unsigned ge(type a, type b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_GE_OQ)); }
+    static unsigned le(type a, type b) { return _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_LE_OQ)); }
+    static size_t compact(uint32_t *out, uint32_t base, unsigned mask) {
+        size_t count = 0;
+        for (size_t i = 0; i < kWidth; i++) {
+            out[count] = base + uint32_t(i);
+            count += (mask >> i) & 1;
+        }
+        return count;
+    }
+};
+#endif
+
+#ifdef __AVX512F__
+struct lanes16 {
+    typedef __m512 type;
+    static constexpr size_t kWidth = 16;
+    static type load(const float *p) { return _mm512_loadu_ps(p); }
+    static type set(float value) { return _mm512_set1_ps(value); }
+    static type add(type a, type b) { return _mm512_add_ps(a, b); }
+    static type sub(type a, type b) { return _mm512_sub_ps(a, b); }
+    static type mul(type a, type b) { return _mm512_mul_ps(a, b); }
+    static type max(type a, type b) { return _mm512_max_ps(a, b); }
+    static unsigned ge(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_GE_OQ); }
+    static unsigned le(type a, type b) { return _mm512_cmp_ps_mask(a, b, _CMP_LE_OQ); }
+    static size_t compact(uint32_t *out, uint32_t base, unsigned mask) {
+        const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+        _mm512_mask_compressstoreu_epi32(out, __mmask16(mask),
+            _mm512_add_epi32(_mm512_set1_epi32(int(base)), lanes));
+        return __builtin_popcount(mask);
+    }
+};
+#endif
+
+#if defined(__AVX512F__)
+typedef lanes16 cullLanes;
+#elif defined(__AVX__)
+typedef lanes8 cullLanes;
+#elif defined(__SSE2__)
+typedef lanes4 cullLanes;
+#else
+typedef lanes1 cullLanes;
+#endif
+
+// The sign of each plane's normal picks which corner of the boxes is furthest
+// along it, if that corner is outside so is the whole box.
+struct frustumTest {
+    frustumTest(const frustum &f) {
+        for (size_t i = 0; i < 6; i++)
+            for (size_t a = 0; a < 3; a++)
+                positive[i][a] = f.planes[i][a] >= 0.0f;
+        memcpy(planes, f.planes, sizeof planes);
+    }
+
+    template <typename L>
+    unsigned test(const bboxes &boxes, size_t i) const {
+        unsigned mask = (1u << L::kWidth) - 1;
+        for (size_t p = 0; p < 6 && mask; p++) {
+            typename L::type distance = L::set(planes[p][3]);
+            for (size_t a = 0; a < 3; a++) {
+                const float *const corner = positive[p][a] ? &boxes.max[a][i] : &boxes.min[a][i];
+                distance = L::add(distance, L::mul(L::load(corner), L::set(planes[p][a])));
+            }
+            mask &= L::ge(distance, L::set(0.0f));
+        }
+        return mask;
+    }
+
+    float planes[6][4];
+    bool positive[6][3];
+};
+
+// Squared distance from the center to the closest point of the boxes
+struct sphereTest {
+    template <typename L>
+    unsigned test(const bboxes &boxes, size_t i) const {
+        typename L::type distance = L::set(0.0f);
+        for (size_t a = 0; a < 3; a++) {
+            const typename L::type c = L::set(center[a]);
+            const typename L::type below = L::sub(L::load(&boxes.min[a][i]), c);
+            const typename L::type above = L::sub(c, L::load(&boxes.max[a][i]));
+            const typename L::type d = L::max(L::max(below, above), L::set(0.0f));
+            distance = L::add(distance, L::mul(d, d));
+        }
+        return L::le(distance, L::set(radius * radius));
+    }
+
+    float center[3];
+    float radius;
+};
+
+struct boxTest {
+    template <typename L>
+    unsigned test(const bboxes &boxes, size_t i) const {
+        unsigned mask = (1u << L::kWidth) - 1;
+        for (size_t a = 0; a < 3; a++) {
+            mask &= L::le(L::load(&boxes.min[a][i]), L::set(max[a]));
+            mask &= L::ge(L::load(&boxes.max[a][i]), L::set(min[a]));
+        }
+        return mask;
+    }
+
+    float min[4];
+    float max[4];
+};
+
+template <typename T>
+static size_t cullRange(const bboxes &boxes, const T &test, size_t begin, size_t end, uint32_t *out) {
+    size_t count = 0;
+    size_t i = begin;
+    for (; i + cullLanes::kWidth <= end; i += cullLanes::kWidth)
+        count += cullLanes::compact(out + count, uint32_t(i), test.template test<cullLanes>(boxes, i));
+    for (; i < end; i++)
+        count += lanes1::compact(out + count, uint32_t(i), test.template test<lanes1>(boxes, i));
+    return count;
+}
+
+template <typename T>
+static size_t cullBoxes(const bboxes &boxes, const T &test, uint32_t *indices, size_t threads) {
+    // Not worth waking threads up for less than this many boxes each
+    const size_t kMinimum = 65536;
+    const size_t count = boxes.size();
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads > count / kMinimum)
+        threads = count / kMinimum;
+    if (threads <= 1)
+        return cullRange(boxes, test, 0, count, indices);
+
+    // Shares are whole vectors so only the last one has a tail
+    const size_t share = ((count + threads - 1) / threads + 15) & ~size_t(15);
+    std::vector<size_t> found(threads);
+    const auto work = [&](size_t thread) {
+        const size_t begin = share * thread < count ? share * thread : count;
+        const size_t end = begin + share < count ? begin + share : count;
+        found[thread] = cullRange(boxes, test, begin, end, indices + begin);
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < threads; i++)
+        pool.emplace_back(work, i);
+    work(0);
+    for (auto &it : pool)
+        it.join();
+
+    size_t total = found[0];
+    for (size_t i = 1; i < threads; i++) {
+        memmove(indices + total, indices + share * i, found[i] * sizeof *indices);
+        total += found[i];
+    }
+    return total;
+}
+
+inline size_t cull(const bboxes &boxes, const frustum &f, uint32_t *indices, size_t threads) {
+    return cullBoxes(boxes, frustumTest(f), indices, threads);
+}
+
+inline size_t cull(const bboxes &boxes, const vec3 &center, float radius, uint32_t *indices, size_t threads) {
+    const sphereTest test = { { center.x, center.y, center.z }, radius };
+    return cullBoxes(boxes, test, indices, threads);
+}
+
+inline size_t cull(const bboxes &boxes, const bbox &box, uint32_t *indices, size_t threads) {
+    boxTest test;
+    components(box.min, test.min);
+    components(box.max, test.max);
+    return cullBoxes(boxes, test, indices, threads);
+}
+
+}
+
+#ifdef M_BBOX_TEST
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+// Every combination of origins on, inside and outside the slabs and directions
+// that are zero, negative zero, denormal, huge or ordinary against a box, a
+// flat box and a point. Each path compiled in is compared with the scalar
+// definition below, build with and without SSE2 (-U__SSE2__) to check both.
+static bool reference(const float *lo, const float *hi, const float *origin,
+    const float *direction, bool robust, float &tnear, float &tfar)
+{
+    const float inf = -logf(0.0f);
+    tnear = -inf;
+    tfar = inf;
+    for (size_t i = 0; i < 3; i++) {
+        const float invert = 1.0f / direction[i];
+        const float l1 = (lo[i] - origin[i]) * invert;
+        const float l2 = (hi[i] - origin[i]) * invert;
+        float lmin;
+        float lmax;
+        if (robust) {
+            // The sign of the inverse, not a comparison, so -0 counts
+            const bool negative = signbit(invert);
+            lmin = negative ? l2 : l1;
+            lmax = (negative ? l1 : l2) * m::kRobust;
+            if (lmin != lmin)
+                lmin = -inf;
+            if (lmax != lmax)
+                lmax = inf;
+        } else if (l1 != l1 || l2 != l2) {
+            lmin = -inf;
+            lmax = inf;
+        } else {
+            lmin = l1 < l2 ? l1 : l2;
+            lmax = l1 < l2 ? l2 : l1;
+        }
+        tnear = lmin > tnear ? lmin : tnear;
+        tfar = lmax < tfar ? lmax : tfar;
+    }
+    return tfar >= 0.0f && tfar >= tnear;
+}
+
+static bool same(bool hit, float tnear, float tfar, bool expectHit, float expectNear, float expectFar) {
+    return hit == expectHit && tnear == expectNear && tfar == expectFar;
+}
+
+int main() {
+    const float kOrigins[] = { -2.0f, -1.0f, -0.5f, -0.0f, 0.0f, 0.5f, 1.0f, 2.0f };
+    const float kDirections[] = { -1.0f, -0.0f, 0.0f, 1.0f, 1e-45f, -1e-45f, 3e38f, 0.25f };
+    const float kBoxes[][2][3] = {
+        { { -1.0f, -1.0f, -1.0f }, { 1.0f, 1.0f, 1.0f } },
+        { { 0.0f, -1.0f, -1.0f }, { 0.0f, 1.0f, 1.0f } },
+        { { 0.5f, 0.5f, 0.5f }, { 0.5f, 0.5f, 0.5f } }
+    };
+    const size_t kValues = sizeof kOrigins / sizeof *kOrigins;
+
+    size_t cases = 0;
+    size_t failures = 0;
+    for (const auto &box : kBoxes) {
+        const m::bbox b(m::vec3(box[0][0], box[0][1], box[0][2]), m::vec3(box[1][0], box[1][1], box[1][2]));
+        const m::bboxN<16> packet(b);
+        for (size_t o = 0; o < kValues * kValues * kValues; o++) {
+            const float origin[3] = { kOrigins[o % kValues], kOrigins[o / kValues % kValues], kOrigins[o / kValues / kValues] };
+            for (size_t d = 0; d < kValues * kValues * kValues; d++) {
+                const float direction[3] = { kDirections[d % kValues], kDirections[d / kValues % kValues], kDirections[d / kValues / kValues] };
+                if (!direction[0] && !direction[1] && !direction[2])
+                    continue;
+                const m::ray r(m::vec3(origin[0], origin[1], origin[2]),
+                               m::vec3(direction[0], direction[1], direction[2]));
+                float expectNear;
+                float expectFar;
+                float tnear;
+                float tfar;
+                bool expect = reference(box[0], box[1], origin, direction, false, expectNear, expectFar);
+                bool hit = b.intersect(r, tnear, tfar);
+                failures += !same(hit, tnear, tfar, expect, expectNear, expectFar);
+
+                m::rayN<16> rays(r);
+                float near[16];
+                float far[16];
+                const unsigned mask = packet.intersect(rays, near, far);
+                failures += !same(mask == 0xFFFF, near[0], far[0], expect, expectNear, expectFar);
+                failures += !same(mask & 1, near[15], far[15], expect, expectNear, expectFar);
+
+                expect = reference(box[0], box[1], origin, direction, true, expectNear, expectFar);
+                hit = b.intersect(m::signedRay(r), tnear, tfar);
+                failures += !same(hit, tnear, tfar, expect, expectNear, expectFar);
+
+                const unsigned signedMask = packet.intersect(m::signedRayN<16>(r), near, far);
+                failures += !same(signedMask == 0xFFFF, near[0], far[0], expect, expectNear, expectFar);
+                failures += !same(signedMask & 1, near[15], far[15], expect, expectNear, expectFar);
+                hit = m::bboxN<4>(b).intersect(m::signedRayN<4>(r), near, far) & 1;
+                failures += !same(hit, near[0], far[0], expect, expectNear, expectFar);
+                hit = m::bboxN<8>(b).intersect(m::signedRayN<8>(r), near, far) & 1;
+                failures += !same(hit, near[0], far[0], expect, expectNear, expectFar);
+
+                // Robust is conservative, it never misses what the other hits
+                if (!expect && reference(box[0], box[1], origin, direction, false, expectNear, expectFar))
+                    failures++;
+                cases++;
+            }
+        }
+    }
+
+    // where is origin + direction * distance in both paths
+    const m::ray r(m::vec3(1.0f, 2.0f, 3.0f), m::vec3(0.5f, -1.0f, 2.0f));
+    const m::vec3 point = r.where(2.0f);
+    failures += point.x != 2.0f || point.y != 0.0f || point.z != 7.0f;
+
+    printf("%zu cases, %zu failures\n", cases, failures);
+    return failures != 0;
+}
+#endif
+
+#ifdef M_BBOX_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+#include <vector>
+
+// Ray/box tests per second of one ray against many boxes, one box at a time
+// with bbox::intersect for both kinds of ray and N at a time with bboxN.
+static float random(float min, float max) {
+    return min + rand() / float(RAND_MAX) * (max - min);
+}
+
+template <typename R>
+static double benchmarkSingle(const std::vector<R> &rays, const std::vector<m::bbox> &boxes) {
+    size_t tests = 0;
+    size_t hits = 0;
+    std::chrono::duration<double> elapsed(0);
+    do {
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto &r : rays) {
+            for (const auto &box : boxes) {
+                float tnear;
+                float tfar;
+                hits += box.intersect(r, tnear, tfar);
+            }
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+        tests += rays.size() * boxes.size();
+    } while (elapsed.count() < 0.5);
+    volatile size_t sink = hits;
+    (void)sink;
+    return tests / elapsed.count();
+}
+
+// Boxes culled per second
+template <typename F>
+static double benchmarkCull(const F &cull, size_t boxes) {
+    size_t culled = 0;
+    size_t kept = 0;
+    std::chrono::duration<double> elapsed(0);
+    do {
+        const auto start = std::chrono::steady_clock::now();
+        kept += cull();
+        elapsed += std::chrono::steady_clock::now() - start;
+        culled += boxes;
+    } while (elapsed.count() < 0.5);
+    volatile size_t sink = kept;
+    (void)sink;
+    return culled / elapsed.count();
+}
+
+template <size_t N, typename R>
+static double benchmarkPacket(const std::vector<m::ray> &rays, const std::vector<m::bbox> &boxes) {
+    std::vector<m::bboxN<N>> packets(boxes.size() / N);
+    for (size_t i = 0; i < packets.size() * N; i++)
+        packets[i / N].set(i % N, boxes[i]);
+    size_t tests = 0;
+    size_t hits = 0;
+    std::chrono::duration<double> elapsed(0);
+    do {
+        const auto start = std::chrono::steady_clock::now();
+        for (const auto &it : rays) {
+            const R r(it);
+            alignas(64) float tnear[N];
+            alignas(64) float tfar[N];
+            for (const auto &packet : packets)
+                hits += __builtin_popcount(packet.intersect(r, tnear, tfar));
+        }
+        elapsed += std::chrono::steady_clock::now() - start;
+        tests += rays.size() * packets.size() * N;
+    } while (elapsed.count() < 0.5);
+    volatile size_t sink = hits;
+    (void)sink;
+    return tests / elapsed.count();
+}
+
+int main() {
+    std::vector<m::ray> rays;
+    std::vector<m::bbox> boxes;
+    for (size_t i = 0; i < 256; i++) {
+        const m::vec3 direction(random(-1.0f, 1.0f), random(-1.0f, 1.0f), random(-1.0f, 1.0f));
+        rays.push_back(m::ray(m::vec3(0.0f, 0.0f, 0.0f), direction));
+    }
+    for (size_t i = 0; i < 4096; i++) {
+        const m::vec3 min(random(-10.0f, 10.0f), random(-10.0f, 10.0f), random(-10.0f, 10.0f));
+        const m::vec3 size(random(0.1f, 2.0f), random(0.1f, 2.0f), random(0.1f, 2.0f));
+        boxes.push_back(m::bbox(min, min + size));
+    }
+
+    const std::vector<m::signedRay> signedRays(rays.begin(), rays.end());
+
+    printf("bbox:   ~%.0f tests/s\n", benchmarkSingle(rays, boxes));
+    printf("signed: ~%.0f tests/s\n", benchmarkSingle(signedRays, boxes));
+    printf("bbox4:  ~%.0f tests/s, signed ~%.0f tests/s\n",
+        benchmarkPacket<4, m::rayN<4>>(rays, boxes), benchmarkPacket<4, m::signedRayN<4>>(rays, boxes));
+    printf("bbox8:  ~%.0f tests/s, signed ~%.0f tests/s\n",
+        benchmarkPacket<8, m::rayN<8>>(rays, boxes), benchmarkPacket<8, m::signedRayN<8>>(rays, boxes));
+    printf("bbox16: ~%.0f tests/s, signed ~%.0f tests/s\n",
+        benchmarkPacket<16, m::rayN<16>>(rays, boxes), benchmarkPacket<16, m::signedRayN<16>>(rays, boxes));
+
+    // A million boxes culled against a frustum with a 90 degree field of view
+    // looking down -z, a sphere and a box, compared with one box at a time.
+    std::vector<m::bbox> scene;
+    m::bboxes culled;
+    for (size_t i = 0; i < (1 << 20); i++) {
+        const m::vec3 min(random(-100.0f, 100.0f), random(-100.0f, 100.0f), random(-100.0f, 100.0f));
+        const m::vec3 size(random(0.1f, 2.0f), random(0.1f, 2.0f), random(0.1f, 2.0f));
+        scene.push_back(m::bbox(min, min + size));
+        culled.push_back(scene.back());
+    }
+    const m::frustum f = { {
+        { 1.0f, 0.0f, -1.0f, 0.0f }, { -1.0f, 0.0f, -1.0f, 0.0f },
+        { 0.0f, 1.0f, -1.0f, 0.0f }, { 0.0f, -1.0f, -1.0f, 0.0f },
+        { 0.0f, 0.0f, -1.0f, -0.1f }, { 0.0f, 0.0f, 1.0f, 100.0f }
+    } };
+    std::vector<uint32_t> indices(scene.size());
+    printf("one at a time: frustum ~%.0f boxes/s\n", benchmarkCull([&]() {
+        size_t count = 0;
+        for (size_t i = 0; i < scene.size(); i++) {
+            float min[4];
+            float max[4];
+            m::components(scene[i].min, min);
+            m::components(scene[i].max, max);
+            bool inside = true;
+            for (size_t p = 0; p < 6 && inside; p++) {
+                float distance = f.planes[p][3];
+                for (size_t a = 0; a < 3; a++)
+                    distance += f.planes[p][a] * (f.planes[p][a] >= 0.0f ? max[a] : min[a]);
+                inside = distance >= 0.0f;
+            }
+            if (inside)
+                indices[count++] = uint32_t(i);
+        }
+        return count;
+    }, scene.size()));
+
+    const size_t hardware = std::thread::hardware_concurrency();
+    for (size_t threads = 1; threads <= (hardware > 1 ? hardware : 1); threads *= 2) {
+        const double frustum = benchmarkCull([&]() {
+            return m::cull(culled, f, &indices[0], threads);
+        }, scene.size());
+        const double sphere = benchmarkCull([&]() {
+            return m::cull(culled, m::vec3(0.0f, 0.0f, 0.0f), 30.0f, &indices[0], threads);
+        }, scene.size());
+        const double box = benchmarkCull([&]() {
+            return m::cull(culled, m::bbox(m::vec3(-20.0f, -20.0f, -20.0f), m::vec3(20.0f, 20.0f, 20.0f)),
+                &indices[0], threads);
+        }, scene.size());
+        printf("%2zu threads: frustum ~%.0f boxes/s, sphere ~%.0f boxes/s, box ~%.0f boxes/s\n",
+            threads, frustum, sphere, box);
+    }
+}
+#endif
+
 #endif
@@ -0,0 +1,617 @@
+#ifndef M_BVH_HDR
+#define M_BVH_HDR
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include "m_bbox.h"
+
+namespace m {
+
+// Bounding volume hierarchy over boxes, each node has four children that are
+// tested against a ray at once with the bbox4 slab test.
+//
+// It's built top down with the surface area heuristic, primitives are put in
+// 16 bins along each axis by their centroid and the cheapest split between
+// bins is taken. Each node is filled by repeatedly splitting the child with
+// the largest surface area until there are four. Subtrees are built in
+// parallel, each thread builds into its own nodes which are appended after.
+//
+// Nodes are kept in one array, a subtree is contiguous, and the primitives are
+// referenced by leaves through an index array so a leaf's are contiguous too.
+//
+// Primitives are anything with a box, closest and any take a function which
+// tests a ray against a primitive:
+//
+//  bool test(uint32_t primitive, float &distance)
+//
+// which returns true and lowers distance when the primitive is hit closer than
+// distance. Without one the primitives are the boxes themselves.
+struct bvh {
+    bvh(const bbox *boxes, size_t count, size_t threads = 0);
+
+    // Closest primitive hit no further than distance along the ray, distance
+    // is set to where it was hit.
+    template <typename F>
+    bool closest(const ray &r, float &distance, uint32_t &primitive, const F &test) const;
+    bool closest(const ray &r, float &distance, uint32_t &primitive) const;
+
+    // Any primitive hit no further than distance, for shadow rays
+    template <typename F>
+    bool any(const ray &r, float distance, const F &test) const;
+    bool any(const ray &r, float distance) const;
+
+    size_t nodes() const;
+
+private:
+    static constexpr size_t kBins = 16;
+    static constexpr size_t kMaxLeaf = 8;
+    // Past this depth splits are at the median so the depth is bounded and the
+    // traversal stack can't overflow.
+    static constexpr size_t kMaxDepth = 32;
+    static constexpr size_t kStack = 3 * 2 * kMaxDepth + 1;
+    // Smallest subtree worth building on another thread
+    static constexpr size_t kParallel = 8192;
+    // Cost of traversing a node relative to testing a primitive
+    static constexpr float kTraversal = 1.0f;
+
+    struct box {
+        float min[3];
+        float max[3];
+
+        void clear();
+        void grow(const box &other);
+        float area() const;
+    };
+
+    struct range {
+        uint32_t begin;
+        uint32_t end;
+        box bounds;
+        // Splitting it costs more than testing the primitives
+        bool leaf;
+    };
+
+    // Children with a count are leaves, the rest are nodes
+    struct node {
+        bbox4 bounds;
+        uint32_t child[4];
+        uint8_t count[4];
+        uint32_t valid;
+    };
+
+    bool split(range &parent, range &left, range &right, size_t depth);
+    uint32_t build(std::vector<node> &nodes, const range *ranges, size_t count,
+        size_t threads, size_t depth);
+
+    template <bool kAny, typename F>
+    bool traverse(const ray &r, float &distance, uint32_t &position, const F &test) const;
+
+    std::vector<node> m_nodes;
+    std::vector<uint32_t> m_indices;
+    std::vector<box> m_boxes;
+    std::vector<bbox> m_primitives;
+};
+
+inline void bvh::box::clear() {
+    for (size_t i = 0; i < 3; i++) {
+        min[i] = std::numeric_limits<float>::infinity();
+        max[i] = -std::numeric_limits<float>::infinity();
+    }
+}
+
+inline void bvh::box::grow(const box &other) {
+    for (size_t i = 0; i < 3; i++) {
+        min[i] = other.min[i] < min[i] ? other.min[i] : min[i];
+        max[i] = other.max[i] > max[i] ? other.max[i] : max[i];
+    }
+}
+
+inline float bvh::box::area() const {
+    const float x = max[0] - min[0];
+    const float y = max[1] - min[1];
+    const float z = max[2] - min[2];
+    return x < 0.0f ? 0.0f : 2.0f * (x*y + y*z + z*x);
+}
+
+inline bvh::bvh(const bbox *boxes, size_t count, size_t threads) {
+    if (count == 0)
+        return;
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    if (threads == 0)
+        threads = 1;
+
+    m_boxes.resize(count);
+    m_indices.resize(count);
+    range root = { 0, uint32_t(count), {}, false };
+    root.bounds.clear();
+    for (size_t i = 0; i < count; i++) {
+        float min[4];
+        float max[4];
+        components(boxes[i].min, min);
+        components(boxes[i].max, max);
+        memcpy(m_boxes[i].min, min, sizeof m_boxes[i].min);
+        memcpy(m_boxes[i].max, max, sizeof m_boxes[i].max);
+        root.bounds.grow(m_boxes[i]);
+        m_indices[i] = uint32_t(i);
+    }
+    build(m_nodes, &root, 1, threads, 0);
+
+    // The boxes in leaf order for when they're the primitives
+    m_primitives.reserve(count);
+    for (size_t i = 0; i < count; i++)
+        m_primitives.push_back(boxes[m_indices[i]]);
+    std::vector<box>().swap(m_boxes);
+}
+
+inline bool bvh::split(range &parent, range &left, range &right, size_t depth) {
+    const size_t count = parent.end - parent.begin;
+    if (count <= 1)
+        return false;
+    uint32_t *const indices = &m_indices[parent.begin];
+
+    // Centroids are min + max, the scale doesn't matter for binning
+    box centroids;
+    centroids.clear();
+    for (size_t i = 0; i < count; i++) {
+        const box &b = m_boxes[indices[i]];
+        for (size_t a = 0; a < 3; a++) {
+            const float c = b.min[a] + b.max[a];
+            centroids.min[a] = c < centroids.min[a] ? c : centroids.min[a];
+            centroids.max[a] = c > centroids.max[a] ? c : centroids.max[a];
+        }
+    }
+
+    size_t axis = 0;
+    for (size_t a = 1; a < 3; a++)
+        if (centroids.max[a] - centroids.min[a] > centroids.max[axis] - centroids.min[axis])
+            axis = a;
+
+    uint32_t *middle = nullptr;
+    if (centroids.max[axis] <= centroids.min[axis]) {
+        // Every centroid is the same, split anywhere if there's too many
+        if (count <= kMaxLeaf)
+            return false;
+        middle = indices + count / 2;
+    } else if (depth >= kMaxDepth) {
+        middle = indices + count / 2;
+        std::nth_element(indices, middle, indices + count, [&](uint32_t a, uint32_t b) {
+            return m_boxes[a].min[axis] + m_boxes[a].max[axis]
+                 < m_boxes[b].min[axis] + m_boxes[b].max[axis];
+        });
+    } else {
+        // All three axes are binned in one pass over the primitives, small
+        // ranges use fewer bins as clearing and sweeping them dominates.
+        const size_t used = count < kBins ? count : kBins;
+        box bins[3][kBins];
+        uint32_t counts[3][kBins] = { { 0 } };
+        float scale[3];
+        for (size_t a = 0; a < 3; a++) {
+            for (size_t i = 0; i < used; i++)
+                bins[a][i].clear();
+            const float extent = centroids.max[a] - centroids.min[a];
+            scale[a] = extent > 0.0f ? used * (1.0f - 1e-5f) / extent : 0.0f;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const box &b = m_boxes[indices[i]];
+            for (size_t a = 0; a < 3; a++) {
+                size_t bin = size_t((b.min[a] + b.max[a] - centroids.min[a]) * scale[a]);
+                bin = bin < used ? bin : used - 1;
+                bins[a][bin].grow(b);
+                counts[a][bin]++;
+            }
+        }
+
+        float bestCost = std::numeric_limits<float>::infinity();
+        size_t bestAxis = 0;
+        size_t bestBin = 0;
+        for (size_t a = 0; a < 3; a++) {
+            if (scale[a] == 0.0f)
+                continue;
+            // Sweep from the right for the cost of everything past each bin
+            float rightCost[kBins];
+            box bounds;
+            bounds.clear();
+            uint32_t total = 0;
+            for (size_t i = used - 1; i > 0; i--) {
+                bounds.grow(bins[a][i]);
+                total += counts[a][i];
+                rightCost[i] = total ? bounds.area() * total : 0.0f;
+            }
+            bounds.clear();
+            total = 0;
+            for (size_t i = 0; i < used - 1; i++) {
+                bounds.grow(bins[a][i]);
+                total += counts[a][i];
+                const float cost = (total ? bounds.area() * total : 0.0f) + rightCost[i + 1];
+                if (total && total < count && cost < bestCost) {
+                    bestCost = cost;
+                    bestAxis = a;
+                    bestBin = i;
+                }
+            }
+        }
+
+        // Both costs are scaled by the area of the parent
+        const float area = parent.bounds.area();
+        if (count <= kMaxLeaf && area * count <= area * kTraversal + bestCost)
+            return false;
+
+        if (bestCost == std::numeric_limits<float>::infinity()) {
+            middle = indices + count / 2;
+        } else {
+            const float min = centroids.min[bestAxis];
+            middle = std::partition(indices, indices + count, [&](uint32_t index) {
+                const box &b = m_boxes[index];
+                const size_t bin = size_t((b.min[bestAxis] + b.max[bestAxis] - min) * scale[bestAxis]);
+                return (bin < used ? bin : used - 1) <= bestBin;
+            });
+        }
+    }
+
+    left.begin = parent.begin;
+    left.end = parent.begin + uint32_t(middle - indices);
+    right.begin = left.end;
+    right.end = parent.end;
+    left.leaf = false;
+    right.leaf = false;
+    left.bounds.clear();
+    right.bounds.clear();
+    for (uint32_t i = left.begin; i < left.end; i++)
+        left.bounds.grow(m_boxes[m_indices[i]]);
+    for (uint32_t i = right.begin; i < right.end; i++)
+        right.bounds.grow(m_boxes[m_indices[i]]);
+    return true;
+}
+
+inline uint32_t bvh::build(std::vector<node> &nodes, const range *ranges, size_t count,
+    size_t threads, size_t depth)
+{
+    // Open up the child with the largest surface area until there are four
+    range children[4];
+    for (size_t i = 0; i < count; i++)
+        children[i] = ranges[i];
+    while (count < 4) {
+        size_t largest = 4;
+        for (size_t i = 0; i < count; i++) {
+            if (children[i].leaf)
+                continue;
+            if (largest == 4 || children[i].bounds.area() > children[largest].bounds.area())
+                largest = i;
+        }
+        if (largest == 4)
+            break;
+        range left;
+        range right;
+        if (!split(children[largest], left, right, depth)) {
+            children[largest].leaf = true;
+            continue;
+        }
+        children[largest] = left;
+        children[count++] = right;
+    }
+
+    const uint32_t index = uint32_t(nodes.size());
+    nodes.emplace_back();
+    node n;
+    memset(&n, 0, sizeof n);
+    n.valid = (1u << count) - 1;
+    range halves[4][2];
+    for (size_t i = 0; i < count; i++) {
+        for (size_t a = 0; a < 3; a++) {
+            n.bounds.min[a][i] = children[i].bounds.min[a];
+            n.bounds.max[a][i] = children[i].bounds.max[a];
+        }
+        // Children that can't be split become leaves, the rest are nodes
+        // that start out with the two halves.
+        if (!children[i].leaf)
+            children[i].leaf = !split(children[i], halves[i][0], halves[i][1], depth + 1);
+        if (children[i].leaf) {
+            n.child[i] = children[i].begin;
+            n.count[i] = uint8_t(children[i].end - children[i].begin);
+        }
+    }
+
+    // The subtrees are split among the threads, the calling thread builds the
+    // first and the rest are appended to nodes as they finish.
+    std::vector<std::thread> pool;
+    std::vector<node> local[4];
+    uint32_t roots[4] = { 0 };
+    size_t spawned = 0;
+    for (size_t i = 1; i < count; i++) {
+        const size_t size = children[i].end - children[i].begin;
+        if (children[i].leaf || threads <= 1 || size < kParallel)
+            continue;
+        const size_t share = threads / count ? threads / count : 1;
+        pool.emplace_back([&, i, share]() {
+            roots[i] = build(local[i], halves[i], 2, share, depth + 1);
+        });
+        spawned |= 1u << i;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (children[i].leaf || (spawned & (1u << i)))
+            continue;
+        const size_t share = spawned ? (threads / count ? threads / count : 1) : threads;
+        n.child[i] = build(nodes, halves[i], 2, share, depth + 1);
+    }
+    for (auto &it : pool)
+        it.join();
+    for (size_t i = 0; i < count; i++) {
+        if (!(spawned & (1u << i)))
+            continue;
+        const uint32_t offset = uint32_t(nodes.size());
+        for (auto &it : local[i]) {
+            for (size_t j = 0; j < 4; j++)
+                if ((it.valid & (1u << j)) && !it.count[j])
+                    it.child[j] += offset;
+            nodes.push_back(it);
+        }
+        n.child[i] = offset + roots[i];
+    }
+    nodes[index] = n;
+    return index;
+}
+
+template <bool kAny, typename F>
+inline bool bvh::traverse(const ray &r, float &distance, uint32_t &position, const F &test) const {
+    if (m_nodes.empty())
+        return false;
+    const signedRayN<4> packet(r);
+    struct entry {
+        uint32_t node;
+        float tnear;
+    };
+    entry stack[kStack];
+    size_t top = 0;
+    stack[top++] = { 0, -std::numeric_limits<float>::infinity() };
+    bool hit = false;
+    while (top) {
+        const entry current = stack[--top];
+        // Something closer was found since it was pushed
+        if (current.tnear > distance)
+            continue;
+        const node &n = m_nodes[current.node];
+        float tnear[4];
+        float tfar[4];
+        unsigned mask = n.bounds.intersect(packet, tnear, tfar) & n.valid;
+
+        // Leaves are tested right away, nodes go on the stack nearest last so
+        // they're visited nearest first.
+        entry next[4];
+        size_t nodes = 0;
+        for (; mask; mask &= mask - 1) {
+            const size_t i = __builtin_ctz(mask);
+            if (tnear[i] > distance)
+                continue;
+            if (n.count[i]) {
+                for (uint32_t j = n.child[i]; j < n.child[i] + n.count[i]; j++) {
+                    if (!test(j, distance))
+                        continue;
+                    position = j;
+                    hit = true;
+                    if (kAny)
+                        return true;
+                }
+                continue;
+            }
+            size_t j = nodes++;
+            for (; j > 0 && next[j - 1].tnear < tnear[i]; j--)
+                next[j] = next[j - 1];
+            next[j] = { n.child[i], tnear[i] };
+        }
+        for (size_t i = 0; i < nodes; i++)
+            stack[top++] = next[i];
+    }
+    return hit;
+}
+
+template <typename F>
+inline bool bvh::closest(const ray &r, float &distance, uint32_t &primitive, const F &test) const {
+    uint32_t position = 0;
+    const auto leaf = [&](uint32_t j, float &d) { return test(m_indices[j], d); };
+    if (!traverse<false>(r, distance, position, leaf))
+        return false;
+    primitive = m_indices[position];
+    return true;
+}
+
+template <typename F>
+inline bool bvh::any(const ray &r, float distance, const F &test) const {
+    uint32_t position = 0;
+    const auto leaf = [&](uint32_t j, float &d) { return test(m_indices[j], d); };
+    return traverse<true>(r, distance, position, leaf);
+}
+
+inline bool bvh::closest(const ray &r, float &distance, uint32_t &primitive) const {
+    uint32_t position = 0;
+    const auto leaf = [&](uint32_t j, float &d) {
+        float tnear;
+        float tfar;
+        if (!m_primitives[j].intersect(r, tnear, tfar))
+            return false;
+        // Inside the box is a hit at the origin
+        tnear = tnear > 0.0f ? tnear : 0.0f;
+        if (tnear > d)
+            return false;
+        d = tnear;
+        return true;
+    };
+    if (!traverse<false>(r, distance, position, leaf))
+        return false;
+    primitive = m_indices[position];
+    return true;
+}
+
+inline bool bvh::any(const ray &r, float distance) const {
+    uint32_t position = 0;
+    const auto leaf = [&](uint32_t j, float &d) {
+        float tnear;
+        float tfar;
+        return m_primitives[j].intersect(r, tnear, tfar) && tnear <= d;
+    };
+    return traverse<true>(r, distance, position, leaf);
+}
+
+inline size_t bvh::nodes() const {
+    return m_nodes.size();
+}
+
+}
+
+#ifdef M_BVH_BENCHMARK
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <chrono>
+
+// Rays per second against a million boxes and a million triangles, the rays
+// start inside the scene and go in random directions.
+static float random(float min, float max) {
+    return min + rand() / float(RAND_MAX) * (max - min);
+}
+
+struct triangle {
+    float v[3][3];
+};
+
+// Möller–Trumbore
+static bool intersect(const triangle &t, const float *o, const float *d, float &distance) {
+    float e1[3];
+    float e2[3];
+    float s[3];
+    for (size_t i = 0; i < 3; i++) {
+        e1[i] = t.v[1][i] - t.v[0][i];
+        e2[i] = t.v[2][i] - t.v[0][i];
+        s[i] = o[i] - t.v[0][i];
+    }
+    const float p[3] = { d[1]*e2[2] - d[2]*e2[1], d[2]*e2[0] - d[0]*e2[2], d[0]*e2[1] - d[1]*e2[0] };
+    const float det = e1[0]*p[0] + e1[1]*p[1] + e1[2]*p[2];
+    if (det > -1e-8f && det < 1e-8f)
+        return false;
+    const float invert = 1.0f / det;
+    const float u = (s[0]*p[0] + s[1]*p[1] + s[2]*p[2]) * invert;
+    if (u < 0.0f || u > 1.0f)
+        return false;
+    const float q[3] = { s[1]*e1[2] - s[2]*e1[1], s[2]*e1[0] - s[0]*e1[2], s[0]*e1[1] - s[1]*e1[0] };
+    const float v = (d[0]*q[0] + d[1]*q[1] + d[2]*q[2]) * invert;
+    if (v < 0.0f || u + v > 1.0f)
+        return false;
+    const float t0 = (e2[0]*q[0] + e2[1]*q[1] + e2[2]*q[2]) * invert;
+    if (t0 <= 0.0f || t0 > distance)
+        return false;
+    distance = t0;
+    return true;
+}
+
+template <typename F>
+static void benchmark(const char *name, const m::bvh &tree, const std::vector<m::ray> &rays,
+    const F &closest, const F &any)
+{
+    double rates[2];
+    const F *tests[2] = { &closest, &any };
+    for (size_t k = 0; k < 2; k++) {
+        size_t traced = 0;
+        size_t hits = 0;
+        std::chrono::duration<double> elapsed(0);
+        do {
+            const auto start = std::chrono::steady_clock::now();
+            for (const auto &r : rays)
+                hits += (*tests[k])(tree, r);
+            elapsed += std::chrono::steady_clock::now() - start;
+            traced += rays.size();
+        } while (elapsed.count() < 1.0);
+        rates[k] = traced / elapsed.count();
+        volatile size_t sink = hits;
+        (void)sink;
+    }
+    printf("%9s: %zu nodes, closest ~%.0f rays/s, any ~%.0f rays/s\n", name,
+        tree.nodes(), rates[0], rates[1]);
+}
+
+int main() {
+    const size_t kPrimitives = 1 << 20;
+    const size_t kRays = 1 << 16;
+
+    std::vector<m::ray> rays;
+    for (size_t i = 0; i < kRays; i++) {
+        const m::vec3 origin(random(-1.0f, 1.0f), random(-1.0f, 1.0f), random(-1.0f, 1.0f));
+        const m::vec3 direction(random(-1.0f, 1.0f), random(-1.0f, 1.0f), random(-1.0f, 1.0f));
+        rays.push_back(m::ray(origin, direction));
+    }
+
+    std::vector<m::bbox> boxes;
+    for (size_t i = 0; i < kPrimitives; i++) {
+        const m::vec3 min(random(-1.0f, 1.0f), random(-1.0f, 1.0f), random(-1.0f, 1.0f));
+        const m::vec3 size(random(0.001f, 0.01f), random(0.001f, 0.01f), random(0.001f, 0.01f));
+        boxes.push_back(m::bbox(min, min + size));
+    }
+
+    const size_t hardware = std::thread::hardware_concurrency();
+    for (size_t threads = 1; threads <= (hardware > 1 ? hardware : 1); threads *= 2) {
+        const auto start = std::chrono::steady_clock::now();
+        m::bvh tree(&boxes[0], boxes.size(), threads);
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        printf("%2zu threads: builds ~%.0f boxes/s\n", threads, boxes.size() / elapsed.count());
+    }
+
+    typedef bool (*trace)(const m::bvh &, const m::ray &);
+    const m::bvh boxTree(&boxes[0], boxes.size());
+    benchmark<trace>("boxes", boxTree, rays,
+        [](const m::bvh &tree, const m::ray &r) {
+            float distance = std::numeric_limits<float>::infinity();
+            uint32_t primitive;
+            return tree.closest(r, distance, primitive);
+        },
+        [](const m::bvh &tree, const m::ray &r) {
+            return tree.any(r, std::numeric_limits<float>::infinity());
+        });
+
+    static std::vector<triangle> triangles;
+    boxes.clear();
+    for (size_t i = 0; i < kPrimitives; i++) {
+        triangle t;
+        const float center[3] = { random(-1.0f, 1.0f), random(-1.0f, 1.0f), random(-1.0f, 1.0f) };
+        float min[3] = { center[0], center[1], center[2] };
+        float max[3] = { center[0], center[1], center[2] };
+        for (size_t j = 0; j < 3; j++) {
+            for (size_t a = 0; a < 3; a++) {
+                t.v[j][a] = center[a] + random(-0.01f, 0.01f);
+                min[a] = t.v[j][a] < min[a] ? t.v[j][a] : min[a];
+                max[a] = t.v[j][a] > max[a] ? t.v[j][a] : max[a];
+            }
+        }
+        triangles.push_back(t);
+        boxes.push_back(m::bbox(m::vec3(min[0], min[1], min[2]), m::vec3(max[0], max[1], max[2])));
+    }
+
+    const m::bvh triangleTree(&boxes[0], boxes.size());
+    benchmark<trace>("triangles", triangleTree, rays,
+        [](const m::bvh &tree, const m::ray &r) {
+            float o[4];
+            float d[4];
+            m::components(r.origin, o);
+            m::components(r.direction, d);
+            float distance = std::numeric_limits<float>::infinity();
+            uint32_t primitive;
+            return tree.closest(r, distance, primitive, [&](uint32_t index, float &t) {
+                return intersect(triangles[index], o, d, t);
+            });
+        },
+        [](const m::bvh &tree, const m::ray &r) {
+            float o[4];
+            float d[4];
+            m::components(r.origin, o);
+            m::components(r.direction, d);
+            return tree.any(r, std::numeric_limits<float>::infinity(), [&](uint32_t index, float &t) {
+                return intersect(triangles[index], o, d, t);
+            });
+        });
+}
+#endif
+
+#endif